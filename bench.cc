@@ -0,0 +1,300 @@
+// Author: Walt Lin
+// Throughput benchmark for protoc-gen-jsonjava. Synthesizes large schemas in
+// memory and times MyCodeGenerator::Generate on them directly, without going
+// through protoc. Output goes to a GeneratorContext that only counts and
+// checksums the bytes, so the numbers are for code generation alone.
+//
+//   $ make bench
+//   $ ./json_bench [iterations] [plugin parameter]
+//
+// The checksum covers every insertion point and its contents, so it changes
+// whenever the generated code does. Optimizations of the generator must not
+// change it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+#include "java_generator.h"
+#include "util.h"
+#include "options.pb.h"
+
+using namespace google::protobuf;
+using namespace google::protobuf::compiler;
+
+// What to synthesize for one scenario. Every file gets "messages" top level
+// messages with "fields" fields each, "maps" of which are dx_map_key maps, and
+// a chain of "depth" nested messages under each top level message.
+struct Shape {
+  const char* name;
+  int files;
+  int messages;
+  int fields;
+  int maps;
+  int depth;
+  int services;
+  int methods;
+};
+
+static const Shape kShapes[] = {
+  // name        files msgs fields maps depth services methods
+  { "many",         50,  100,     8,   0,    0,       0,      0 },
+  { "wide",         10,   10,   300,   0,    0,       0,      0 },
+  { "deep",         20,   10,     6,   0,   12,       0,      0 },
+  { "maps",         20,   50,    12,  10,    0,       0,      0 },
+  { "services",     20,   20,     6,   0,    0,       5,     20 },
+};
+
+// Generator output sink; counts and checksums the bytes written to it.
+class BenchContext : public GeneratorContext {
+ public:
+  BenchContext() : bytes_(0), hash_(14695981039346656037ULL) {}
+
+  virtual io::ZeroCopyOutputStream* Open(const string& filename) {
+    Record(filename.data(), filename.size());
+    return new CountingOutputStream(this);
+  }
+
+  virtual io::ZeroCopyOutputStream* OpenForInsert(
+      const string& filename, const string& insertion_point) {
+    Record(filename.data(), filename.size());
+    Record(insertion_point.data(), insertion_point.size());
+    return new CountingOutputStream(this);
+  }
+
+  int64 bytes() const { return bytes_; }
+  uint64 hash() const { return hash_; }
+
+ private:
+  class CountingOutputStream : public io::ZeroCopyOutputStream {
+   public:
+    explicit CountingOutputStream(BenchContext* context)
+        : context_(context), count_(0), pending_(0) {}
+    virtual ~CountingOutputStream() { Flush(); }
+
+    virtual bool Next(void** data, int* size) {
+      Flush();
+      *data = buffer_;
+      *size = pending_ = sizeof(buffer_);
+      return true;
+    }
+    virtual void BackUp(int count) { pending_ -= count; }
+    virtual int64 ByteCount() const { return count_ + pending_; }
+
+   private:
+    void Flush() {
+      context_->Record(buffer_, pending_);
+      context_->bytes_ += pending_;
+      count_ += pending_;
+      pending_ = 0;
+    }
+
+    BenchContext* context_;
+    int64 count_;
+    int pending_;
+    char buffer_[8192];
+  };
+
+  // FNV-1a.
+  void Record(const char* data, int size) {
+    for (int i = 0; i < size; i++) {
+      hash_ = (hash_ ^ static_cast<unsigned char>(data[i])) * 1099511628211ULL;
+    }
+  }
+
+  int64 bytes_;
+  uint64 hash_;
+};
+
+static const FieldDescriptorProto::Type kFieldTypes[] = {
+  FieldDescriptorProto::TYPE_DOUBLE,
+  FieldDescriptorProto::TYPE_FLOAT,
+  FieldDescriptorProto::TYPE_INT64,
+  FieldDescriptorProto::TYPE_INT32,
+  FieldDescriptorProto::TYPE_BOOL,
+  FieldDescriptorProto::TYPE_STRING,
+  FieldDescriptorProto::TYPE_ENUM,
+  FieldDescriptorProto::TYPE_MESSAGE,
+};
+static const int kNumFieldTypes = sizeof(kFieldTypes) / sizeof(kFieldTypes[0]);
+
+static FieldDescriptorProto* AddField(DescriptorProto* msg, const string& name,
+                                      FieldDescriptorProto::Type type,
+                                      bool repeated) {
+  FieldDescriptorProto* field = msg->add_field();
+  field->set_name(name);
+  field->set_number(msg->field_size());
+  field->set_type(type);
+  field->set_label(repeated ? FieldDescriptorProto::LABEL_REPEATED
+                            : FieldDescriptorProto::LABEL_OPTIONAL);
+  return field;
+}
+
+// Adds the fields of a message; message typed fields refer to "leaf", which
+// is a message without message fields of its own.
+static void AddFields(const Shape& shape, const string& package,
+                      const string& leaf, DescriptorProto* msg) {
+  for (int i = 0; i < shape.fields - shape.maps; i++) {
+    FieldDescriptorProto::Type type = kFieldTypes[i % kNumFieldTypes];
+    bool repeated = (i / kNumFieldTypes) % 2 == 1;
+    FieldDescriptorProto* field =
+        AddField(msg, "field_" + compiler::SimpleItoa(i), type, repeated);
+    if (type == FieldDescriptorProto::TYPE_ENUM) {
+      field->set_type_name(package + ".Kind");
+    } else if (type == FieldDescriptorProto::TYPE_MESSAGE) {
+      field->set_type_name(leaf);
+    }
+  }
+  for (int i = 0; i < shape.maps; i++) {
+    string entry = "Map" + compiler::SimpleItoa(i) + "Entry";
+    DescriptorProto* entry_msg = msg->add_nested_type();
+    entry_msg->set_name(entry);
+    AddField(entry_msg, "key", FieldDescriptorProto::TYPE_STRING, false);
+    FieldDescriptorProto* val = AddField(
+        entry_msg, "value",
+        i % 2 == 0 ? FieldDescriptorProto::TYPE_DOUBLE
+                   : FieldDescriptorProto::TYPE_MESSAGE, false);
+    if (i % 2 == 1) {
+      val->set_type_name(leaf);
+    }
+    FieldDescriptorProto* field =
+        AddField(msg, "map_" + compiler::SimpleItoa(i),
+                 FieldDescriptorProto::TYPE_MESSAGE, true);
+    field->set_type_name(entry);
+    field->mutable_options()->SetExtension(dx_map_key, "key");
+    field->mutable_options()->SetExtension(dx_map_val, "value");
+  }
+}
+
+static void SynthesizeFile(const Shape& shape, int n,
+                           FileDescriptorProto* file) {
+  string package = string("bench.") + shape.name + compiler::SimpleItoa(n);
+  file->set_name(package + ".proto");
+  file->set_package(package);
+  file->add_dependency("options.proto");
+  file->mutable_options()->set_java_package("com." + package);
+  file->mutable_options()->set_java_outer_classname(
+      "Bench" + compiler::SimpleItoa(n));
+
+  EnumDescriptorProto* kind = file->add_enum_type();
+  kind->set_name("Kind");
+  for (int i = 0; i < 4; i++) {
+    kind->add_value()->set_name("KIND_" + compiler::SimpleItoa(i));
+    kind->mutable_value(i)->set_number(i);
+  }
+
+  DescriptorProto* leaf = file->add_message_type();
+  leaf->set_name("Leaf");
+  AddField(leaf, "name", FieldDescriptorProto::TYPE_STRING, false);
+  AddField(leaf, "value", FieldDescriptorProto::TYPE_DOUBLE, false);
+
+  for (int i = 0; i < shape.messages; i++) {
+    DescriptorProto* msg = file->add_message_type();
+    msg->set_name("M" + compiler::SimpleItoa(i));
+    AddFields(shape, "." + package, "." + package + ".Leaf", msg);
+    for (int d = 0; d < shape.depth; d++) {
+      msg = msg->add_nested_type();
+      msg->set_name("N" + compiler::SimpleItoa(d));
+      AddFields(shape, "." + package, "." + package + ".Leaf", msg);
+    }
+  }
+
+  for (int i = 0; i < shape.services; i++) {
+    ServiceDescriptorProto* service = file->add_service();
+    service->set_name("Service" + compiler::SimpleItoa(i));
+    for (int j = 0; j < shape.methods; j++) {
+      MethodDescriptorProto* method = service->add_method();
+      method->set_name("Call" + compiler::SimpleItoa(j));
+      string input = compiler::SimpleItoa(j % shape.messages);
+      string output = compiler::SimpleItoa((j + 1) % shape.messages);
+      method->set_input_type("." + package + ".M" + input);
+      method->set_output_type("." + package + ".M" + output);
+      DXMethodOptions* options =
+          method->mutable_options()->MutableExtension(dx_method_options);
+      options->set_path("/service/:serviceId/call" + compiler::SimpleItoa(j) +
+                        "/:itemId");
+      options->set_http_method(j % 2 == 0 ? "GET" : "POST");
+    }
+  }
+}
+
+// Adds a file from the generated pool, and its dependencies, to pool.
+static void CopyGeneratedFile(const string& name, DescriptorPool* pool) {
+  const FileDescriptor* file =
+      DescriptorPool::generated_pool()->FindFileByName(name);
+  for (int i = 0; i < file->dependency_count(); i++) {
+    CopyGeneratedFile(file->dependency(i)->name(), pool);
+  }
+  if (pool->FindFileByName(name) == NULL) {
+    FileDescriptorProto proto;
+    file->CopyTo(&proto);
+    pool->BuildFile(proto);
+  }
+}
+
+static double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 5;
+  string parameter = argc > 2 ? argv[2] : "";
+
+  printf("%-10s %6s %9s %10s %14s %10s  %s\n", "scenario", "files",
+         "messages", "seconds", "messages/sec", "MB/sec", "checksum");
+  for (int s = 0; s < sizeof(kShapes) / sizeof(kShapes[0]); s++) {
+    const Shape& shape = kShapes[s];
+    DescriptorPool pool;
+    CopyGeneratedFile("options.proto", &pool);
+    vector<const FileDescriptor*> files;
+    int messages = 0;
+    for (int i = 0; i < shape.files; i++) {
+      FileDescriptorProto proto;
+      SynthesizeFile(shape, i, &proto);
+      const FileDescriptor* file = pool.BuildFile(proto);
+      if (file == NULL) {
+        fprintf(stderr, "couldn't build %s\n", proto.name().c_str());
+        return 1;
+      }
+      files.push_back(file);
+      vector<const Descriptor*> all;
+      CollectMessages(file, &all);
+      messages += all.size();
+    }
+
+    MyCodeGenerator generator;
+    int64 bytes = 0;
+    uint64 hash = 0;
+    double start = Now();
+    for (int it = 0; it < iterations; it++) {
+      BenchContext context;
+      for (int i = 0; i < files.size(); i++) {
+        string error;
+        if (!generator.Generate(files[i], parameter, &context, &error)) {
+          return 1;
+        }
+      }
+      if (it > 0 && context.hash() != hash) {
+        fprintf(stderr, "%s: output differs between iterations\n",
+                shape.name);
+        return 1;
+      }
+      bytes += context.bytes();
+      hash = context.hash();
+    }
+    double seconds = Now() - start;
+
+    printf("%-10s %6d %9d %10.3f %14.0f %10.2f  %016llx\n", shape.name,
+           shape.files, messages, seconds,
+           messages * iterations / seconds,
+           bytes / seconds / (1024 * 1024),
+           static_cast<unsigned long long>(hash));
+  }
+  return 0;
+}
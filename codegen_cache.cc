@@ -0,0 +1,151 @@
+#include "codegen_cache.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <set>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/io/printer.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+namespace google {
+namespace protobuf {
+namespace compiler {
+
+static const char kCacheMagic[] = "protobuf-with-json cache 2\n";
+
+io::ZeroCopyOutputStream* RecordingContext::Open(const std::string& filename) {
+  return OpenForInsert(filename, "");
+}
+
+io::ZeroCopyOutputStream* RecordingContext::OpenForInsert(
+    const std::string& filename, const std::string& insertion_point) {
+  outputs_.push_back(CachedOutput());
+  outputs_.back().filename = filename;
+  outputs_.back().insertion_point = insertion_point;
+  return new io::StringOutputStream(&outputs_.back().content);
+}
+
+// Serializes the file and everything it imports, each once, imports first.
+static void SerializeWithDependencies(const FileDescriptor* file,
+                                      std::set<const FileDescriptor*>* seen,
+                                      std::string* out) {
+  if (!seen->insert(file).second) {
+    return;
+  }
+  for (int i = 0; i < file->dependency_count(); i++) {
+    SerializeWithDependencies(file->dependency(i), seen, out);
+  }
+  FileDescriptorProto proto;
+  file->CopyTo(&proto);
+  std::string bytes;
+  proto.SerializeToString(&bytes);
+  char size[32];
+  snprintf(size, sizeof(size), "%zu\n", bytes.size());
+  out->append(size);
+  out->append(bytes);
+}
+
+// FNV-1a, 64 bits.
+static unsigned long long Hash(const std::string& s, unsigned long long h) {
+  for (size_t i = 0; i < s.size(); i++) {
+    h = (h ^ static_cast<unsigned char>(s[i])) * 1099511628211ULL;
+  }
+  return h;
+}
+
+std::string CodegenCacheKey(const FileDescriptor* file,
+                            const std::string& options,
+                            const std::string& version) {
+  std::string key = version + "\n" + options + "\n";
+  std::set<const FileDescriptor*> seen;
+  SerializeWithDependencies(file, &seen, &key);
+  return key;
+}
+
+std::string CodegenCachePath(const std::string& cache_dir,
+                             const std::string& key) {
+  // Two differently seeded hashes make collisions rare; they are still
+  // possible, which is why entries hold their key.
+  char name[40];
+  snprintf(name, sizeof(name), "%016llx%016llx",
+           Hash(key, 14695981039346656037ULL), Hash(key, 0x9e3779b97f4a7c15ULL));
+  return cache_dir + "/" + name;
+}
+
+static bool ReadAll(FILE* f, size_t size, std::string* out) {
+  out->resize(size);
+  return size == 0 || fread(&(*out)[0], 1, size, f) == size;
+}
+
+bool LoadCachedOutputs(const std::string& path, const std::string& key,
+                       std::vector<CachedOutput>* outputs) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (f == NULL) {
+    return false;
+  }
+  std::string magic;
+  bool ok = ReadAll(f, sizeof(kCacheMagic) - 1, &magic) &&
+            magic == kCacheMagic;
+  size_t key_size;
+  std::string stored_key;
+  ok = ok && fscanf(f, "%zu\n", &key_size) == 1 &&
+       key_size == key.size() && ReadAll(f, key_size, &stored_key) &&
+       stored_key == key;
+  size_t sizes[3];
+  while (ok && fscanf(f, "%zu %zu %zu\n", &sizes[0], &sizes[1],
+                      &sizes[2]) == 3) {
+    CachedOutput output;
+    ok = ReadAll(f, sizes[0], &output.filename) &&
+         ReadAll(f, sizes[1], &output.insertion_point) &&
+         ReadAll(f, sizes[2], &output.content);
+    outputs->push_back(output);
+  }
+  ok = ok && feof(f);
+  fclose(f);
+  return ok;
+}
+
+void StoreCachedOutputs(const std::string& path, const std::string& key,
+                        const std::vector<CachedOutput>& outputs) {
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".tmp%d", static_cast<int>(getpid()));
+  std::string tmp = path + suffix;
+  FILE* f = fopen(tmp.c_str(), "wb");
+  if (f == NULL) {
+    return;
+  }
+  fputs(kCacheMagic, f);
+  fprintf(f, "%zu\n", key.size());
+  fwrite(key.data(), 1, key.size(), f);
+  for (size_t i = 0; i < outputs.size(); i++) {
+    const CachedOutput& output = outputs[i];
+    fprintf(f, "%zu %zu %zu\n", output.filename.size(),
+            output.insertion_point.size(), output.content.size());
+    fwrite(output.filename.data(), 1, output.filename.size(), f);
+    fwrite(output.insertion_point.data(), 1, output.insertion_point.size(), f);
+    fwrite(output.content.data(), 1, output.content.size(), f);
+  }
+  bool ok = !ferror(f);
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    remove(tmp.c_str());
+  }
+}
+
+void ReplayCachedOutputs(const std::vector<CachedOutput>& outputs,
+                         GeneratorContext* context) {
+  for (size_t i = 0; i < outputs.size(); i++) {
+    const CachedOutput& output = outputs[i];
+    scoped_ptr<io::ZeroCopyOutputStream> stream(
+        output.insertion_point.empty()
+            ? context->Open(output.filename)
+            : context->OpenForInsert(output.filename,
+                                     output.insertion_point));
+    io::Printer printer(stream.get(), '$');
+    printer.PrintRaw(output.content);
+  }
+}
+
+}  // namespace compiler
+}  // namespace protobuf
+}  // namespace google
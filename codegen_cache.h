@@ -0,0 +1,73 @@
+// Author: Walt Lin
+// On-disk cache of generated code, for incremental builds. An entry holds
+// everything a generator wrote for one .proto file, and is keyed by a hash of
+// that file, its transitive imports, the plugin options that affect the
+// output and the plugin version; a hit replays the entry instead of running the generator.
+
+#ifndef PROTOBUF_FOR_PB_CODEGEN_CACHE_H__
+#define PROTOBUF_FOR_PB_CODEGEN_CACHE_H__
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <google/protobuf/compiler/code_generator.h>
+
+namespace google {
+namespace protobuf {
+namespace compiler {
+
+// One file or insertion point written by a generator.
+struct CachedOutput {
+  std::string filename;
+  std::string insertion_point;  // Empty for a whole file.
+  std::string content;
+};
+
+// A GeneratorContext that keeps all output in memory, so that it can be
+// stored in the cache and then written to the real context.
+class RecordingContext : public GeneratorContext {
+ public:
+  virtual io::ZeroCopyOutputStream* Open(const std::string& filename);
+  virtual io::ZeroCopyOutputStream* OpenForInsert(
+      const std::string& filename, const std::string& insertion_point);
+
+  std::vector<CachedOutput> outputs() const {
+    return std::vector<CachedOutput>(outputs_.begin(), outputs_.end());
+  }
+
+ private:
+  // A deque, so that open streams keep pointing at valid strings.
+  std::deque<CachedOutput> outputs_;
+};
+
+// Returns the key of the cache entry for generating file with the given
+// options: the version, the options and the serialized file and imports.
+// options should only hold what changes the output, in a canonical form.
+std::string CodegenCacheKey(const FileDescriptor* file,
+                            const std::string& options,
+                            const std::string& version);
+
+// Returns the path of the cache entry for key, under cache_dir. Different
+// keys may share a path; the entry holds the full key to tell them apart.
+std::string CodegenCachePath(const std::string& cache_dir,
+                             const std::string& key);
+
+// Reads a cache entry; returns false if there is none, it is unreadable, or
+// it was stored for another key.
+bool LoadCachedOutputs(const std::string& path, const std::string& key,
+                       std::vector<CachedOutput>* outputs);
+
+// Writes a cache entry atomically. Failures are ignored; the cache is only
+// an optimization.
+void StoreCachedOutputs(const std::string& path, const std::string& key,
+                        const std::vector<CachedOutput>& outputs);
+
+// Writes the outputs to the context, in order.
+void ReplayCachedOutputs(const std::vector<CachedOutput>& outputs,
+                         GeneratorContext* context);
+
+}  // namespace compiler
+}  // namespace protobuf
+}  // namespace google
+
+#endif  // PROTOBUF_FOR_PB_CODEGEN_CACHE_H__
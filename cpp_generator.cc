@@ -0,0 +1,622 @@
+// Author: Walt Lin
+// Protobuf compiler to C++ json functions. For foo.proto this generates
+// foo.json.h and foo.json.cc, next to the foo.pb.h from --cpp_out, with
+//
+//   bool ToJson(const Foo& msg, std::string* out);
+//   bool ParseFromJson(::dxjson::JsonReader* reader, Foo* msg);
+//   bool ParseFromJson(const std::string& json, Foo* msg);
+//
+// for every message Foo, in the message's namespace. The json is the same as
+// what protoc-gen-jsonjava reads and writes. The generated code only depends
+// on jsoncpp_runtime.h; it uses no reflection.
+
+#include <stdio.h>
+#include <ctype.h>
+#include <set>
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/plugin.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/io/printer.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+#include "util.h"
+
+using namespace google::protobuf;
+using namespace google::protobuf::compiler;
+
+// Converts a proto package to a C++ namespace, e.g. "a.b" becomes "::a::b".
+static string CppNamespace(const FileDescriptor* file) {
+  string ns;
+  string package = file->package();
+  while (!package.empty()) {
+    size_t i = package.find('.');
+    ns += "::" + package.substr(0, i);
+    if (i == string::npos) {
+      break;
+    }
+    package = package.substr(i + 1);
+  }
+  return ns;
+}
+
+// Fully qualified C++ name for a message or enum with the given full name,
+// e.g. "a.b.Outer.Inner" in package "a.b" becomes "::a::b::Outer_Inner".
+static string CppClassName(const string& full_name,
+                           const FileDescriptor* file) {
+  string name = full_name;
+  if (!file->package().empty()) {
+    name = name.substr(file->package().size() + 1);
+  }
+  for (size_t i = 0; i < name.size(); i++) {
+    if (name[i] == '.') {
+      name[i] = '_';
+    }
+  }
+  return CppNamespace(file) + "::" + name;
+}
+
+static string CppClassName(const Descriptor* d) {
+  return CppClassName(d->full_name(), d->file());
+}
+
+static string CppClassName(const EnumDescriptor* d) {
+  return CppClassName(d->full_name(), d->file());
+}
+
+// The words protoc's C++ generator appends "_" to in field names.
+static const char* const kCppKeywords[] = {
+  "alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand", "bitor",
+  "bool", "break", "case", "catch", "char", "class", "compl", "const",
+  "constexpr", "const_cast", "continue", "decltype", "default", "delete", "do",
+  "double", "dynamic_cast", "else", "enum", "explicit", "export", "extern",
+  "false", "float", "for", "friend", "goto", "if", "inline", "int", "long",
+  "mutable", "namespace", "new", "noexcept", "not", "not_eq", "NULL",
+  "operator", "or", "or_eq", "private", "protected", "public", "register",
+  "reinterpret_cast", "return", "short", "signed", "sizeof", "static",
+  "static_assert", "static_cast", "struct", "switch", "template", "this",
+  "thread_local", "throw", "true", "try", "typedef", "typeid", "typename",
+  "union", "unsigned", "using", "virtual", "void", "volatile", "wchar_t",
+  "while", "xor", "xor_eq",
+};
+
+// The name protoc uses for the field's accessors: lowercased, and with "_"
+// appended if that is a C++ keyword, e.g. class_().
+static string CppFieldName(const FieldDescriptor* d) {
+  static const std::set<string> keywords(
+      kCppKeywords,
+      kCppKeywords + sizeof(kCppKeywords) / sizeof(kCppKeywords[0]));
+  string name = d->name();
+  for (size_t i = 0; i < name.size(); i++) {
+    name[i] = tolower(name[i]);
+  }
+  if (keywords.count(name) > 0) {
+    name += "_";
+  }
+  return name;
+}
+
+// Given a C++ expression and its type, return a statement appending its json
+// encoding to "out", or returning false for numbers json can't hold. As in
+// the java writers, singular enums are written by
+// number and enums in arrays and maps by name; enum_as_number picks which.
+static string AppendJsonValue(const string& expr, const FieldDescriptor* d,
+                              bool enum_as_number) {
+  if (d->cpp_type() == FieldDescriptor::CPPTYPE_ENUM && !enum_as_number) {
+    return "::dxjson::AppendString(out, " + CppClassName(d->enum_type()) +
+        "_Name(" + expr + "));
+";
+  }
+  switch (d->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+      return "if (!::dxjson::AppendDouble(out, " + expr + ")) {\n"
+          "  return false;\n"
+          "}\n";
+    case FieldDescriptor::CPPTYPE_FLOAT:
+      return "if (!::dxjson::AppendFloat(out, " + expr + ")) {\n"
+          "  return false;\n"
+          "}\n";
+    case FieldDescriptor::CPPTYPE_INT64:
+    case FieldDescriptor::CPPTYPE_INT32:
+    case FieldDescriptor::CPPTYPE_ENUM:
+      return "::dxjson::AppendInt64(out, " + expr + ");\n";
+    case FieldDescriptor::CPPTYPE_UINT64:
+    case FieldDescriptor::CPPTYPE_UINT32:
+      return "::dxjson::AppendUint64(out, " + expr + ");\n";
+    case FieldDescriptor::CPPTYPE_BOOL:
+      return "::dxjson::AppendBool(out, " + expr + ");\n";
+    case FieldDescriptor::CPPTYPE_STRING:
+      return "::dxjson::AppendString(out, " + expr + ");\n";
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+      return "if (!ToJson(" + expr + ", out)) {\n"
+          "  return false;\n"
+          "}\n";
+    default:
+      return "UNKNOWN;\n";
+  }
+}
+
+// Given a scalar field type, return the C++ type and JsonReader method used
+// to read it.
+static string CppType(const FieldDescriptor* d) {
+  switch (d->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+      return "double";
+    case FieldDescriptor::CPPTYPE_FLOAT:
+      return "float";
+    case FieldDescriptor::CPPTYPE_INT64:
+      return "int64_t";
+    case FieldDescriptor::CPPTYPE_UINT64:
+      return "uint64_t";
+    case FieldDescriptor::CPPTYPE_INT32:
+    case FieldDescriptor::CPPTYPE_ENUM:
+      return "int32_t";
+    case FieldDescriptor::CPPTYPE_UINT32:
+      return "uint32_t";
+    case FieldDescriptor::CPPTYPE_BOOL:
+      return "bool";
+    default:
+      return "UNKNOWN";
+  }
+}
+
+static string ReaderMethod(const FieldDescriptor* d) {
+  switch (d->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+      return "ReadDouble";
+    case FieldDescriptor::CPPTYPE_FLOAT:
+      return "ReadFloat";
+    case FieldDescriptor::CPPTYPE_INT64:
+      return "ReadInt64";
+    case FieldDescriptor::CPPTYPE_UINT64:
+      return "ReadUint64";
+    case FieldDescriptor::CPPTYPE_INT32:
+    case FieldDescriptor::CPPTYPE_ENUM:
+      return "ReadInt32";
+    case FieldDescriptor::CPPTYPE_UINT32:
+      return "ReadUint32";
+    case FieldDescriptor::CPPTYPE_BOOL:
+      return "ReadBool";
+    case FieldDescriptor::CPPTYPE_STRING:
+      return "ReadString";
+    default:
+      return "UNKNOWN";
+  }
+}
+
+class FieldGenerator {
+ public:
+  FieldGenerator(const FieldDescriptor* descriptor, string* error)
+      : descriptor_(descriptor), is_map_(false),
+        map_key_(NULL), map_val_(NULL), packed_(false) {
+    vars_["field"] = CppFieldName(descriptor);
+    vars_["json_field"] = JsonFieldName(descriptor);
+    vars_["type"] = CppType(descriptor);
+    packed_ = IsPackedField(descriptor, error);
+    is_map_ = GetMapFields(descriptor, &map_key_, &map_val_, error);
+    if (is_map_) {
+      if (map_key_ != NULL && map_val_ != NULL) {
+        vars_["entry_type"] = CppClassName(descriptor->message_type());
+        vars_["key_field"] = CppFieldName(map_key_);
+        vars_["val_field"] = CppFieldName(map_val_);
+      }
+    }
+  }
+
+  void GenerateToJson(io::Printer* printer) {
+    if (is_map_) {
+      printer->Print(vars_,
+          "if (msg.$field$_size() > 0) {\n"
+          "  ::dxjson::AppendKey(out, start, \"\\\"$json_field$\\\":\");\n"
+          "  out->push_back('{');\n"
+          "  for (int i = 0; i < msg.$field$_size(); i++) {\n"
+          "    const $entry_type$& el = msg.$field$(i);\n"
+          "    if (i > 0) {\n"
+          "      out->push_back(',');\n"
+          "    }\n"
+          "    ::dxjson::AppendString(out, el.$key_field$());\n"
+          "    out->push_back(':');\n");
+      printer->Indent();
+      printer->Indent();
+      printer->Print(vars_,
+          AppendJsonValue("el.$val_field$()", map_val_, false).c_str());
+      printer->Outdent();
+      printer->Outdent();
+      printer->Print(
+          "  }\n"
+          "  out->push_back('}');\n"
+          "}\n");
+
+    } else if (packed_) {
+      printer->Print(vars_,
+          "if (msg.$field$_size() > 0) {\n"
+          "  ::dxjson::AppendKey(out, start, \"\\\"$json_field$\\\":\");\n"
+          "  ::dxjson::AppendPacked(out, msg.$field$().data(), msg.$field$_size());\n"
+          "}\n");
+
+    } else if (descriptor_->is_repeated()) {
+      printer->Print(vars_,
+          "if (msg.$field$_size() > 0) {\n"
+          "  ::dxjson::AppendKey(out, start, \"\\\"$json_field$\\\":\");\n"
+          "  out->push_back('[');\n"
+          "  for (int i = 0; i < msg.$field$_size(); i++) {\n"
+          "    if (i > 0) {\n"
+          "      out->push_back(',');\n"
+          "    }\n");
+      printer->Indent();
+      printer->Indent();
+      printer->Print(vars_,
+          AppendJsonValue("msg.$field$(i)", descriptor_, false).c_str());
+      printer->Outdent();
+      printer->Outdent();
+      printer->Print(
+          "  }\n"
+          "  out->push_back(']');\n"
+          "}\n");
+
+    } else {
+      printer->Print(vars_,
+          "if (msg.has_$field$()) {\n"
+          "  ::dxjson::AppendKey(out, start, \"\\\"$json_field$\\\":\");\n");
+      printer->Indent();
+      printer->Print(vars_,
+          AppendJsonValue("msg.$field$()", descriptor_, true).c_str());
+      printer->Outdent();
+      printer->Print("}\n");
+    }
+  }
+
+  // One branch of the key dispatch in ParseFromJson. The reader is
+  // positioned on the (non-null) value of the field.
+  void GenerateParseJson(io::Printer* printer) {
+    if (is_map_) {
+      // This is a map. Decode into an array of items.
+      printer->Print(vars_,
+          "if (!reader->BeginObject()) {\n"
+          "  return false;\n"
+          "}\n"
+          "std::string entry_key;\n"
+          "while (reader->NextKey(&entry_key)) {\n"
+          "  if (reader->ConsumeNull()) {\n"
+          "    continue;\n"
+          "  }\n"
+          "  $entry_type$* item = msg->add_$field$();\n"
+          "  item->set_$key_field$(entry_key);\n");
+      printer->Indent();
+      PrintRead(printer, map_val_,
+                "item->set_" + vars_["val_field"],
+                "item->mutable_" + vars_["val_field"] + "()");
+      printer->Outdent();
+      printer->Print(
+          "}\n"
+          "if (!reader->ok()) {\n"
+          "  return false;\n"
+          "}\n");
+
+    } else if (packed_) {
+      printer->Print(vars_,
+          "if (!reader->ReadPacked<$type$>(msg->mutable_$field$())) {\n"
+          "  return false;\n"
+          "}\n");
+
+    } else if (descriptor_->is_repeated()) {
+      printer->Print(
+          "if (!reader->BeginArray()) {\n"
+          "  return false;\n"
+          "}\n"
+          "while (reader->NextElement()) {\n");
+      printer->Indent();
+      PrintRead(printer, descriptor_,
+                "msg->add_" + vars_["field"],
+                "msg->add_" + vars_["field"] + "()");
+      printer->Outdent();
+      printer->Print(
+          "}\n"
+          "if (!reader->ok()) {\n"
+          "  return false;\n"
+          "}\n");
+
+    } else {
+      PrintRead(printer, descriptor_,
+                "msg->set_" + vars_["field"],
+                "msg->mutable_" + vars_["field"] + "()");
+    }
+  }
+
+ private:
+  // Read the current value as field d. Scalars are passed to the setter;
+  // strings and messages are read in place into the pointer returned by
+  // mutable_expr. Enums may be given by number or name; unknown ones are
+  // dropped.
+  static void PrintRead(io::Printer* printer, const FieldDescriptor* d,
+                        const string& setter, const string& mutable_expr) {
+    map<string, string> vars;
+    vars["setter"] = setter;
+    vars["mutable"] = mutable_expr;
+    vars["read"] = ReaderMethod(d);
+    vars["type"] = CppType(d);
+    switch (d->cpp_type()) {
+      case FieldDescriptor::CPPTYPE_MESSAGE:
+        printer->Print(vars,
+            "if (!ParseFromJson(reader, $mutable$)) {\n"
+            "  return false;\n"
+            "}\n");
+        break;
+      case FieldDescriptor::CPPTYPE_STRING:
+        printer->Print(vars,
+            "if (!reader->ReadString($mutable$)) {\n"
+            "  return false;\n"
+            "}\n");
+        break;
+      case FieldDescriptor::CPPTYPE_ENUM:
+        vars["enum_type"] = CppClassName(d->enum_type());
+        printer->Print(vars,
+            "int32_t number = 0;\n"
+            "std::string name;\n"
+            "if (!reader->ReadEnum(&number, &name)) {\n"
+            "  return false;\n"
+            "}\n"
+            "if (name.empty()) {\n"
+            "  if ($enum_type$_IsValid(number)) {\n"
+            "    $setter$(static_cast<$enum_type$>(number));\n"
+            "  }\n"
+            "} else {\n"
+            "  $enum_type$ value;\n"
+            "  if ($enum_type$_Parse(name, &value)) {\n"
+            "    $setter$(value);\n"
+            "  }\n"
+            "}\n");
+        break;
+      default:
+        printer->Print(vars,
+            "$type$ value;\n"
+            "if (!reader->$read$(&value)) {\n"
+            "  return false;\n"
+            "}\n"
+            "$setter$(value);\n");
+        break;
+    }
+  }
+
+  const FieldDescriptor* descriptor_;
+  map<string, string> vars_;
+  bool is_map_;
+  const FieldDescriptor* map_key_;
+  const FieldDescriptor* map_val_;
+  bool packed_;
+};
+
+// Generate the json functions of a message.
+class MessageGenerator {
+ public:
+  MessageGenerator(const Descriptor* descriptor, string* error)
+      : descriptor_(descriptor), error_(error) {
+    vars_["classname"] = CppClassName(descriptor_);
+    fields_.reserve(descriptor_->field_count());
+    for (int i = 0; i < descriptor_->field_count(); i++) {
+      fields_.push_back(FieldGenerator(descriptor_->field(i), error_));
+    }
+  }
+
+  void GenerateHeader(io::Printer* printer) {
+    printer->Print(vars_,
+        "bool ToJson(const $classname$& msg, std::string* out);\n"
+        "bool ParseFromJson(::dxjson::JsonReader* reader, $classname$* msg);\n"
+        "bool ParseFromJson(const std::string& json, $classname$* msg);\n"
+        "\n");
+  }
+
+  void GenerateSource(io::Printer* printer) {
+    GenerateToJson(printer);
+    printer->Print("\n");
+    GenerateParseJson(printer);
+    printer->Print("\n");
+  }
+
+ private:
+  // ToJson function; appends to out. Returns false for NaN and infinite
+  // numbers, which json can't hold, as the java writers throw on them.
+  void GenerateToJson(io::Printer* printer) {
+    printer->Print(vars_,
+        "bool ToJson(const $classname$& msg, std::string* out) {\n"
+        "  out->push_back('{');\n");
+    printer->Indent();
+    // Messages without fields don't use msg or start.
+    printer->Print(descriptor_->field_count() == 0
+                   ? "(void) msg;\n"
+                   : "const size_t start = out->size();\n");
+    for (int i = 0; i < descriptor_->field_count(); i++) {
+      fields_[i].GenerateToJson(printer);
+    }
+    printer->Print(
+        "out->push_back('}');\n"
+        "return true;\n");
+    printer->Outdent();
+    printer->Print("}\n");
+  }
+
+  // ParseFromJson functions. Keys are matched in a single pass over the
+  // input, with a switch on their length and first character, so each key
+  // is only compared with the few field names that share both; unknown keys
+  // and nulls are skipped.
+  void GenerateParseJson(io::Printer* printer) {
+    printer->Print(vars_,
+        "bool ParseFromJson(::dxjson::JsonReader* reader, $classname$* msg) {\n");
+    if (descriptor_->field_count() == 0) {
+      printer->Print("  (void) msg;\n");
+    }
+    printer->Print(
+        "  if (!reader->BeginObject()) {\n"
+        "    return false;\n"
+        "  }\n"
+        "  std::string key;\n"
+        "  while (reader->NextKey(&key)) {\n"
+        "    if (reader->ConsumeNull()) {\n"
+        "      continue;\n"
+        "    }\n");
+    printer->Indent();
+    printer->Indent();
+    // Field indexes by name length, then by first character.
+    map<int, map<char, vector<int> > > groups;
+    for (int i = 0; i < descriptor_->field_count(); i++) {
+      string name = JsonFieldName(descriptor_->field(i));
+      groups[name.size()][name[0]].push_back(i);
+    }
+    if (!groups.empty()) {
+      printer->Print("switch (key.size()) {\n");
+      for (map<int, map<char, vector<int> > >::iterator len = groups.begin();
+           len != groups.end(); ++len) {
+        printer->Print(
+            "case $len$:\n"
+            "  switch (key[0]) {\n",
+            "len", SimpleItoa(len->first));
+        printer->Indent();
+        for (map<char, vector<int> >::iterator first = len->second.begin();
+             first != len->second.end(); ++first) {
+          printer->Print("case '$first$':\n", "first",
+                         string(1, first->first));
+          printer->Indent();
+          for (size_t j = 0; j < first->second.size(); j++) {
+            int i = first->second[j];
+            printer->Print("if (key == \"$json_field$\") {\n",
+                           "json_field", JsonFieldName(descriptor_->field(i)));
+            printer->Indent();
+            fields_[i].GenerateParseJson(printer);
+            printer->Print("continue;\n");
+            printer->Outdent();
+            printer->Print("}\n");
+          }
+          printer->Print("break;\n");
+          printer->Outdent();
+        }
+        printer->Outdent();
+        printer->Print(
+            "  }\n"
+            "  break;\n");
+      }
+      printer->Print("}\n");
+    }
+    printer->Print(
+        "if (!reader->SkipValue()) {\n"
+        "  return false;\n"
+        "}\n");
+    printer->Outdent();
+    printer->Outdent();
+    printer->Print(vars_,
+        "  }\n"
+        "  return reader->ok();\n"
+        "}\n"
+        "\n"
+        "bool ParseFromJson(const std::string& json, $classname$* msg) {\n"
+        "  ::dxjson::JsonReader reader(json.data(), json.size());\n"
+        "  return ParseFromJson(&reader, msg) && reader.AtEnd();\n"
+        "}\n");
+  }
+
+  const Descriptor* descriptor_;
+  string* error_;
+  map<string, string> vars_;
+  vector<FieldGenerator> fields_;
+};
+
+
+class MyCodeGenerator : public CodeGenerator {
+ public:
+  virtual ~MyCodeGenerator() {}
+
+  static void OpenNamespace(const FileDescriptor* file, io::Printer* printer) {
+    string ns = CppNamespace(file);
+    while (!ns.empty()) {
+      size_t i = ns.find("::", 2);
+      printer->Print("namespace $ns$ {\n", "ns", ns.substr(2, i - 2));
+      if (i == string::npos) {
+        break;
+      }
+      ns = ns.substr(i);
+    }
+    printer->Print("\n");
+  }
+
+  static void CloseNamespace(const FileDescriptor* file, io::Printer* printer) {
+    string ns = CppNamespace(file);
+    while (!ns.empty()) {
+      size_t i = ns.rfind("::");
+      printer->Print("}  // namespace $ns$\n", "ns", ns.substr(i + 2));
+      ns = ns.substr(0, i);
+    }
+  }
+
+  virtual bool Generate(const FileDescriptor* file,
+                        const string& /* parameter */,
+                        GeneratorContext* context,
+                        string* error) const {
+    string basename = Basename(file->name());
+    vector<const Descriptor*> messages;
+    CollectMessages(file, &messages);
+
+    // Other files whose messages we use; we need their ToJson/ParseFromJson.
+    std::set<string> deps;
+    for (size_t i = 0; i < messages.size(); i++) {
+      for (int j = 0; j < messages[i]->field_count(); j++) {
+        const Descriptor* type = messages[i]->field(j)->message_type();
+        if (type != NULL && type->file() != file) {
+          deps.insert(Basename(type->file()->name()));
+        }
+      }
+    }
+
+    {
+      scoped_ptr<io::ZeroCopyOutputStream> output(
+          context->Open(basename + ".json.h"));
+      io::Printer printer(output.get(), '$');
+      string guard = basename + "_JSON_H__";
+      for (size_t i = 0; i < guard.size(); i++) {
+        guard[i] = isalnum(guard[i]) ? toupper(guard[i]) : '_';
+      }
+      printer.Print(kFileHeader);
+      printer.Print(
+          "#ifndef $guard$\n"
+          "#define $guard$\n"
+          "\n"
+          "#include <string>\n"
+          "#include \"jsoncpp_runtime.h\"\n"
+          "#include \"$basename$.pb.h\"\n",
+          "guard", guard, "basename", basename);
+      for (std::set<string>::iterator it = deps.begin(); it != deps.end();
+           ++it) {
+        printer.Print("#include \"$dep$.json.h\"\n", "dep", *it);
+      }
+      printer.Print("\n");
+      OpenNamespace(file, &printer);
+      for (size_t i = 0; i < messages.size(); i++) {
+        MessageGenerator(messages[i], error).GenerateHeader(&printer);
+      }
+      CloseNamespace(file, &printer);
+      printer.Print("\n#endif  // $guard$\n", "guard", guard);
+    }
+
+    {
+      scoped_ptr<io::ZeroCopyOutputStream> output(
+          context->Open(basename + ".json.cc"));
+      io::Printer printer(output.get(), '$');
+      printer.Print(kFileHeader);
+      printer.Print("#include \"$basename$.json.h\"\n\n",
+                    "basename", basename);
+      OpenNamespace(file, &printer);
+      for (size_t i = 0; i < messages.size(); i++) {
+        MessageGenerator(messages[i], error).GenerateSource(&printer);
+      }
+      CloseNamespace(file, &printer);
+    }
+
+    if (!error->empty()) {
+      fprintf(stderr, "ERROR: %s\n", error->c_str());
+    }
+    return error->empty();
+  }
+};
+
+int main(int argc, char* argv[]) {
+  MyCodeGenerator generator;
+  return google::protobuf::compiler::PluginMain(argc, argv, &generator);
+}
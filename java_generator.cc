@@ -2,17 +2,25 @@
 // Protobuf compiler to Java services.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <set>
 #include <google/protobuf/compiler/code_generator.h>
-#include <google/protobuf/compiler/plugin.h>
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/descriptor.pb.h>
 #include <google/protobuf/io/printer.h>
 #include <google/protobuf/io/zero_copy_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 
+#include "java_generator.h"
+#include "codegen_cache.h"
 #include "util.h"
 #include "java_helper.h"
 #include "options.pb.h"  // for method options
+#include "plugin_version.h"  // generated by make
 
 using namespace google::protobuf;
 using namespace google::protobuf::compiler;
@@ -123,115 +131,648 @@ static string JavaValueToString(const string& expr, const FieldDescriptor* d) {
   return BoxJavaValue(expr, d) + ".toString()";
 }
 
-// Sigh; we use "_id" as a field name, and we don't want to turn that into "Id".
-static string MyUnderscoresToCamelCase(const FieldDescriptor* fd) {
-  return fd->name() == "_id" ? "_id" : java::UnderscoresToCamelCase(fd);
+// Given a java expression and its type, return a statement that streams its
+// JSON encoding into "out", formatted exactly as org.json would format it.
+// org.json stringifies enums stored in arrays or objects by name, but we put
+// singular enums into json by number; enum_as_number picks between the two.
+static string WriteJsonValue(const string& expr, const FieldDescriptor* d,
+                             bool enum_as_number) {
+  switch (d->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+    case FieldDescriptor::CPPTYPE_FLOAT:
+      return "$outer$.writeJSONNumber(out, " + expr + ");\n";
+    case FieldDescriptor::CPPTYPE_STRING:
+      return "$outer$.writeJSONString(out, " + expr + ");\n";
+    case FieldDescriptor::CPPTYPE_ENUM:
+      if (enum_as_number) {
+        return "out.append(" + expr + ".getNumber());\n";
+      }
+      return "$outer$.writeJSONString(out, " + expr + ".toString());\n";
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+      return expr + ".writeJSON(out);\n";
+    default:
+      return "out.append(" + expr + ");\n";
+  }
+}
+
+// Given a java expression and its type, return a statement that appends its
+// value to the query string in "out", formatted as toMap formats it.
+static string WriteQueryValue(const string& expr, const FieldDescriptor* d) {
+  switch (d->type()) {
+    case FieldDescriptor::TYPE_STRING:
+      return "$outer$.writeQueryEscaped(out, " + expr + ");\n";
+    case FieldDescriptor::TYPE_BYTES:
+      return "$outer$.writeQueryEscaped(out, " + expr + ".toStringUtf8());\n";
+    case FieldDescriptor::TYPE_ENUM:
+      return "out.append(" + expr + ".getNumber());\n";
+    default:
+      // Numbers and booleans need no escaping.
+      return "out.append(" + expr + ");\n";
+  }
+}
+
+// Name of the static constant holding the pre-encoded json key of the field.
+// The field name keeps its case: uppercased, fooBar and foobar would clash.
+static string JsonKeyConstant(const FieldDescriptor* fd) {
+  return "JSON_KEY_" + fd->name();
+}
+
+// Given a scalar field type, return a java expression that reads the current
+// token of a Jackson JsonParser named "parser" as that type. Numbers and
+// booleans go through the readJSON helpers of the outer class "outer", which
+// parse strings the way org.json does.
+static string JacksonReadValue(const FieldDescriptor* d, const string& outer) {
+  switch (d->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+      return outer + ".readJSONDouble(parser)";
+    case FieldDescriptor::CPPTYPE_FLOAT:
+      return "(float) " + outer + ".readJSONDouble(parser)";
+    case FieldDescriptor::CPPTYPE_INT64:
+    case FieldDescriptor::CPPTYPE_UINT64:
+      return outer + ".readJSONLong(parser)";
+    case FieldDescriptor::CPPTYPE_INT32:
+    case FieldDescriptor::CPPTYPE_UINT32:
+    case FieldDescriptor::CPPTYPE_ENUM:
+      return outer + ".readJSONInt(parser)";
+    case FieldDescriptor::CPPTYPE_BOOL:
+      return outer + ".readJSONBoolean(parser)";
+    case FieldDescriptor::CPPTYPE_STRING:
+      return "parser.getValueAsString()";
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+      return java::ClassName(d->message_type()) + ".parseFromJSON(parser)";
+    default:
+      return "UNKNOWN";
+  }
+}
+
+// Given a scalar field type, return a java condition that is true if the
+// current token of "parser" can't be read by JacksonReadValue. As in the
+// org.json parser, numbers and booleans may also be given as strings.
+static string JacksonWrongToken(const FieldDescriptor* d) {
+  const string token = "parser.getCurrentToken()";
+  const string not_string =
+      token + " != com.fasterxml.jackson.core.JsonToken.VALUE_STRING";
+  switch (d->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_BOOL:
+      return "!" + token + ".isBoolean() &&\n    " + not_string;
+    case FieldDescriptor::CPPTYPE_STRING:
+      return "!" + token + ".isScalarValue() ||\n    " + token +
+          " == com.fasterxml.jackson.core.JsonToken.VALUE_NULL";
+    default:
+      return "!" + token + ".isNumeric() &&\n    " + not_string;
+  }
+}
+
+// For dx_packed fields, the name of the element type in the packed helpers,
+// e.g. encodeJSONPackedDoubles.
+static string PackedJavaName(const FieldDescriptor* d) {
+  switch (d->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+      return "Doubles";
+    case FieldDescriptor::CPPTYPE_FLOAT:
+      return "Floats";
+    case FieldDescriptor::CPPTYPE_INT64:
+    case FieldDescriptor::CPPTYPE_UINT64:
+      return "Longs";
+    default:
+      return "Ints";
+  }
 }
 
+// Settings passed to the plugin, e.g. --jsonjava_out=backend=jackson:outdir.
+struct GeneratorOptions {
+  GeneratorOptions()
+      : jackson(false), field_masks(false), json_diff(false),
+        bytes_transport(false), query_string(false), threads(1) {}
+
+  // Parses the comma-separated key=value parameter string given by protoc.
+  bool Parse(const string& parameter, string* error) {
+    vector<pair<string, string> > options;
+    ParseGeneratorParameter(parameter, &options);
+    for (int i = 0; i < options.size(); i++) {
+      const string& key = options[i].first;
+      const string& value = options[i].second;
+      if (key == "backend" && value == "orgjson") {
+        jackson = false;
+      } else if (key == "backend" && value == "jackson") {
+        jackson = true;
+      } else if (key == "field_masks" && (value == "true" || value == "false")) {
+        field_masks = value == "true";
+      } else if (key == "transport" && (value == "json" || value == "bytes")) {
+        bytes_transport = value == "bytes";
+      } else if (key == "query_string" &&
+                 (value == "true" || value == "false")) {
+        query_string = value == "true";
+      } else if (key == "json_diff" && (value == "true" || value == "false")) {
+        json_diff = value == "true";
+      } else if (key == "cache_dir" && !value.empty()) {
+        cache_dir = value;
+      } else if (key == "threads" && !value.empty() &&
+                 value.find_first_not_of("0123456789") == string::npos) {
+        threads = atoi(value.c_str());
+        if (threads == 0) {
+          threads = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        // sysconf says -1 if it doesn't know.
+        if (threads < 1) {
+          threads = 1;
+        }
+      } else {
+        error->assign("unknown plugin parameter: " + key + "=" + value);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // The options that change the generated code, in a fixed order; threads
+  // and cache_dir don't. Used instead of the parameter in codegen cache keys,
+  // so that the same options spelled differently share entries.
+  string OutputKey() const {
+    string key;
+    key += jackson ? "backend=jackson" : "backend=orgjson";
+    key += field_masks ? ",field_masks=true" : ",field_masks=false";
+    key += json_diff ? ",json_diff=true" : ",json_diff=false";
+    key += bytes_transport ? ",transport=bytes" : ",transport=json";
+    key += query_string ? ",query_string=true" : ",query_string=false";
+    return key;
+  }
+
+  // Also generate parseFromJSON(com.fasterxml.jackson.core.JsonParser), which
+  // parses straight off the token stream instead of from a JSONObject.
+  bool jackson;
+
+  // Also generate toJSON(mask) and parseFromJSON(json, mask), which only
+  // touch the fields selected by a JSONMask.
+  bool field_masks;
+
+  // Also generate toJSONDiff(previous) and applyJSONDiff(json, builder), and
+  // allow methods with DXMethodOptions.diff.
+  bool json_diff;
+
+  // The transport hooks of services (doCall etc) take the request as UTF-8
+  // json, and a ResponseDecoder instead of the response class.
+  bool bytes_transport;
+
+  // Also generate writeQueryString on every message, and send the requests
+  // of GET methods in the query string of the path, with null params.
+  bool query_string;
+
+  // Number of threads rendering messages; 0 means one per cpu.
+  int threads;
+
+  // If set, generated code is cached in this directory, see codegen_cache.h.
+  string cache_dir;
+};
+
+// The variants of the toJSON and parseFromJSON methods of a message.
+enum JsonVariant {
+  kPlainJson,    // toJSON(), parseFromJSON(json).
+  kCompactJson,  // toCompactJSON(), parseFromCompactJSON(json): field
+                 // numbers as keys.
+  kMaskedJson,   // toJSON(mask), parseFromJSON(json, mask): only the fields
+                 // selected by a JSONMask.
+  kDiffJson,     // toJSONDiff(previous), applyJSONDiff(json, builder): only
+                 // the fields that changed.
+};
+
 class FieldGenerator {
  public:
+  // Sets up the field for the plain json methods; ForVariant derives the
+  // generator of the other variants from this one.
   FieldGenerator(const FieldDescriptor* descriptor, string* error)
       : descriptor_(descriptor), error_(error), is_map_(false),
-        map_key_(NULL), map_val_(NULL) {
-    vars_["field"] = MyUnderscoresToCamelCase(descriptor);
+        map_key_(NULL), map_val_(NULL), packed_(false), parallel_(false),
+        lazy_field_(false), lazy_(false), bytecode_size_(0) {
+    vars_["field"] = JsonFieldName(descriptor);
+    // The bit of the field in JSONMask.bits.
+    char bit[32];
+    snprintf(bit, sizeof(bit), "0x%llxL", 1ULL << (descriptor->index() % 64));
+    vars_["mask_word"] = compiler::SimpleItoa(descriptor->index() / 64);
+    vars_["mask_bit"] = bit;
+    vars_["index"] = compiler::SimpleItoa(descriptor->index());
     vars_["upperfield"] = java::UnderscoresToCapitalizedCamelCase(descriptor);
     vars_["jsontype"] = GetJsonType(descriptor);
     vars_["javatype"] = GetJavaType(descriptor);
+    vars_["outer"] = java::ClassName(descriptor->file());
+    vars_["json_key"] = JsonKeyConstant(descriptor);
 
-    const FieldOptions& opts = descriptor->options();
-    string map_key = opts.GetExtension(dx_map_key);
-    string map_val = opts.GetExtension(dx_map_val);
-    is_map_ = !map_key.empty();
+    is_map_ = GetMapFields(descriptor, &map_key_, &map_val_, error);
     if (is_map_) {
-      const Descriptor* msg = descriptor_->message_type();
-      map_key_ = msg->FindFieldByName(map_key);
-      map_val_ = msg->FindFieldByName(map_val);
-      if (map_key_ == NULL || map_val_ == NULL) {
-        error->assign("couldn't look up key or val");
-      } else {
+      if (map_key_ != NULL && map_val_ != NULL) {
         vars_["key_field"] = java::UnderscoresToCapitalizedCamelCase(map_key_);
         vars_["val_field"] = java::UnderscoresToCapitalizedCamelCase(map_val_);
         vars_["val_type"] = GetJsonType(map_val_);
         vars_["val_java_type"] = GetBoxedJavaType(map_val_);
+        vars_["write_val"] = WriteJsonValue("el.get$val_field$()", map_val_, false);
       }
     }
+    packed_ = IsPackedField(descriptor, error);
+    if (packed_) {
+      vars_["packed"] = PackedJavaName(descriptor);
+    }
+    parallel_ = IsParallelField(descriptor, error);
+    // Only the plain parseFromJSON defers dx_lazy fields, but every writer
+    // reads them through the accessors that parse the kept json.
+    lazy_field_ = IsLazyField(descriptor, error);
+    vars_["has_value"] = "has" + vars_["upperfield"] +
+        (lazy_field_ ? "Lazily()" : "()");
+    vars_["get_value"] = "get" + vars_["upperfield"] +
+        (lazy_field_ ? "Lazily()" : "()");
+    bytecode_size_ = EstimateBytecodeSize(descriptor);
+    SetVariant(kPlainJson);
+  }
+
+  // A copy of this generator for the given variant, which determines the
+  // json read and written by GenerateParseJson and GenerateToJson.
+  FieldGenerator ForVariant(JsonVariant variant) const {
+    FieldGenerator copy(*this);
+    copy.SetVariant(variant);
+    return copy;
+  }
+
+  bool is_lazy() const { return lazy_field_; }
+
+  // Rough size in bytes of the bytecode for this field, in the biggest of the
+  // generated methods of the variant. Only used to decide when to split those
+  // methods.
+  int bytecode_size(JsonVariant variant) const {
+    // Diffs compare with the previous value before writing it.
+    return variant == kDiffJson ? 2 * bytecode_size_ : bytecode_size_;
   }
 
   void GenerateParseJson(io::Printer* printer) {
+    // Scalars skip nulls; maps, arrays and messages throw on them.
+    if (is_map_ || descriptor_->is_repeated() ||
+        descriptor_->type() == FieldDescriptor::TYPE_MESSAGE) {
+      printer->Print(vars_, "if (json.has(\"$key$\")) {\n");
+    } else {
+      printer->Print(vars_,
+          "if (json.has(\"$key$\") && !json.isNull(\"$key$\")) {\n");
+    }
+    printer->Indent();
+    GenerateParseJsonValue(printer);
+    printer->Outdent();
+    printer->Print("}\n");
+  }
+
+  // GenerateParseJson and GenerateToJson, if the field is in "mask".
+  void GenerateMaskedParseJson(io::Printer* printer) {
+    printer->Print(vars_, "if ((mask.bits[$mask_word$] & $mask_bit$) != 0) {\n");
+    printer->Indent();
+    GenerateParseJson(printer);
+    printer->Outdent();
+    printer->Print("}\n");
+  }
+
+  void GenerateMaskedToJson(io::Printer* printer) {
+    printer->Print(vars_, "if ((mask.bits[$mask_word$] & $mask_bit$) != 0) {\n");
+    printer->Indent();
+    GenerateToJson(printer);
+    printer->Outdent();
+    printer->Print("}\n");
+  }
+
+  // Writes the field to json if it differs from the field in previous: the
+  // new value, or null if the field was cleared. Maps only get the changed
+  // keys, with null for removed ones, and singular messages their own diff.
+  void GenerateToJsonDiff(io::Printer* printer) {
+    if (is_map_) {
+      printer->Print(vars_,
+          "if (!get$upperfield$List().equals(previous.get$upperfield$List())) {\n"
+          "  java.util.HashMap<String, $javatype$> before =\n"
+          "      new java.util.HashMap<String, $javatype$>();\n"
+          "  for (int i = 0; i < previous.get$upperfield$Count(); i++) {\n"
+          "    $javatype$ el = previous.get$upperfield$(i);\n"
+          "    before.put(el.get$key_field$(), el);\n"
+          "  }\n"
+          "  org.json.JSONObject obj = new org.json.JSONObject();\n"
+          "  for (int i = 0; i < get$upperfield$Count(); i++) {\n"
+          "    $javatype$ el = get$upperfield$(i);\n"
+          "    String key = el.get$key_field$();\n"
+          "    if (!el.equals(before.remove(key))) {\n");
+      if (map_val_->type() == FieldDescriptor::TYPE_MESSAGE) {
+        printer->Print(vars_,
+          "      obj.put(key, el.get$val_field$().toJSON());\n");
+      } else {
+        printer->Print(vars_,
+          "      obj.put(key, el.get$val_field$());\n");
+      }
+      printer->Print(vars_,
+          "    }\n"
+          "  }\n"
+          "  for (String key : before.keySet()) {\n"
+          "    obj.put(key, org.json.JSONObject.NULL);\n"
+          "  }\n"
+          "  if (obj.length() > 0) {\n"
+          "    json.put(\"$key$\", obj);\n"
+          "  }\n"
+          "}\n");
+
+    } else if (descriptor_->is_repeated()) {
+      printer->Print(vars_,
+          "if (!get$upperfield$List().equals(previous.get$upperfield$List())) {\n"
+          "  if (get$upperfield$Count() == 0) {\n"
+          "    json.put(\"$key$\", org.json.JSONObject.NULL);\n"
+          "  }\n");
+      printer->Indent();
+      GenerateToJson(printer);
+      printer->Outdent();
+      printer->Print("}\n");
+
+    } else if (descriptor_->type() == FieldDescriptor::TYPE_MESSAGE) {
+      printer->Print(vars_,
+          "if ($has_value$ != previous.$has_value$ ||\n"
+          "    !$get_value$.equals(previous.$get_value$)) {\n"
+          "  if ($has_value$) {\n"
+          "    json.put(\"$key$\",\n"
+          "        $get_value$.toJSONDiff(previous.$get_value$));\n"
+          "  } else {\n"
+          "    json.put(\"$key$\", org.json.JSONObject.NULL);\n"
+          "  }\n"
+          "}\n");
+
+    } else {
+      bool object = descriptor_->type() == FieldDescriptor::TYPE_STRING ||
+                    descriptor_->type() == FieldDescriptor::TYPE_BYTES;
+      printer->Print(vars_,
+          "if (has$upperfield$() != previous.has$upperfield$() ||\n");
+      printer->Print(vars_, object
+          ? "    !get$upperfield$().equals(previous.get$upperfield$())) {\n"
+          : "    get$upperfield$() != previous.get$upperfield$()) {\n");
+      printer->Print(vars_,
+          "  if (!has$upperfield$()) {\n"
+          "    json.put(\"$key$\", org.json.JSONObject.NULL);\n"
+          "  }\n");
+      printer->Indent();
+      GenerateToJson(printer);
+      printer->Outdent();
+      printer->Print("}\n");
+    }
+  }
+
+  // One case of the key switch in applyJSONDiff: null clears the field, maps
+  // merge per key and singular messages apply their own diff; other values
+  // replace the field.
+  void GenerateApplyJsonDiffCase(io::Printer* printer) {
+    printer->Print(vars_,
+        "case \"$key$\": {\n"
+        "  if (json.isNull(\"$key$\")) {\n"
+        "    builder.clear$upperfield$();\n"
+        "    break;\n"
+        "  }\n");
+    printer->Indent();
+    if (is_map_) {
+      printer->Print(vars_,
+          "org.json.JSONObject obj = json.getJSONObject(\"$key$\");\n"
+          "java.util.ArrayList<$javatype$> kept =\n"
+          "    new java.util.ArrayList<$javatype$>(builder.get$upperfield$List());\n"
+          "builder.clear$upperfield$();\n"
+          "for (int i = 0; i < kept.size(); i++) {\n"
+          "  if (!obj.has(kept.get(i).get$key_field$())) {\n"
+          "    builder.add$upperfield$(kept.get(i));\n"
+          "  }\n"
+          "}\n"
+          "java.util.Iterator<String> keys = obj.keys();\n"
+          "$javatype$.Builder item = $javatype$.acquireJSONBuilder();\n"
+          "while (keys.hasNext()) {\n"
+          "  String key = keys.next();\n"
+          "  if (obj.isNull(key)) {\n"
+          "    continue;\n"
+          "  }\n"
+          "  item.clear();\n"
+          "  item.set$key_field$(key);\n");
+      if (map_val_->type() == FieldDescriptor::TYPE_MESSAGE) {
+        printer->Print(vars_,
+          "  item.set$val_field$($val_java_type$.parseFromJSON(obj.getJSONObject(key)));\n");
+      } else {
+        printer->Print(vars_,
+          "  item.set$val_field$(obj.get$val_type$(key));\n");
+      }
+      printer->Print(vars_,
+          "  builder.add$upperfield$(item.build());\n"
+          "}\n"
+          "$javatype$.releaseJSONBuilder(item);\n");
+
+    } else if (!descriptor_->is_repeated() &&
+               descriptor_->type() == FieldDescriptor::TYPE_MESSAGE) {
+      printer->Print(vars_,
+          "$javatype$.Builder sub = builder.get$upperfield$().toBuilder();\n"
+          "$javatype$.applyJSONDiff(json.getJSONObject(\"$key$\"), sub);\n"
+          "builder.set$upperfield$(sub.build());\n");
+
+    } else {
+      if (descriptor_->is_repeated()) {
+        printer->Print(vars_, "builder.clear$upperfield$();\n");
+      }
+      GenerateParseJsonValue(printer);
+    }
+    printer->Print("break;\n");
+    printer->Outdent();
+    printer->Print("}\n");
+  }
+
+  // One case of the switch in JSONMask.add. Paths into a message field build
+  // a mask of their own, unless the field as a whole is already selected.
+  void GenerateMaskCase(io::Printer* printer) {
+    printer->Print(vars_,
+        "case \"$field$\":\n"
+        "  index = $index$;\n");
+    if (!vars_["child_mask"].empty()) {
+      printer->Print(vars_,
+          "  if (rest != null) {\n"
+          "    if ((bits[$mask_word$] & $mask_bit$) == 0) {\n"
+          "      bits[$mask_word$] |= $mask_bit$;\n"
+          "      children[$index$] = new $javatype$.JSONMask();\n"
+          "    }\n"
+          "    if (children[$index$] != null) {\n"
+          "      (($javatype$.JSONMask) children[$index$]).add(rest);\n"
+          "    }\n"
+          "    return;\n"
+          "  }\n");
+    }
+    printer->Print("  break;\n");
+  }
+
+  // For dx_lazy fields, in parseFromJSON: keeps the JSONObject of the field
+  // on the built message "result", without copying it. Like the eager parse,
+  // null or a value that isn't an object throws.
+  void GenerateKeepLazy(io::Printer* printer) {
+    if (!lazy_) {
+      return;
+    }
+    printer->Print(vars_,
+        "if (json.has(\"$key$\")) {\n"
+        "  result.lazy$upperfield$ = json.getJSONObject(\"$key$\");\n"
+        "}\n");
+  }
+
+  // For dx_lazy fields, in materializeJSON: sets the field on "builder",
+  // made from this message on first use, if parseFromJSON deferred it.
+  void GenerateMaterializeLazy(io::Printer* printer) {
+    if (!lazy_) {
+      return;
+    }
+    printer->Print(vars_,
+        "if (lazy$upperfield$ != null) {\n"
+        "  if (builder == null) {\n"
+        "    builder = toBuilder();\n"
+        "  }\n"
+        "  builder.set$upperfield$(get$upperfield$Lazily());\n"
+        "}\n");
+  }
+
+  // For dx_lazy fields: the member holding the kept json, replaced by the
+  // parsed message on first use, and the accessors that parse it. Racing
+  // threads may both parse it, but get equal messages.
+  void GenerateLazyAccessors(io::Printer* printer) {
+    if (!lazy_) {
+      return;
+    }
+    printer->Print(vars_,
+        "private volatile Object lazy$upperfield$;\n"
+        "\n"
+        "public $javatype$ get$upperfield$Lazily() throws org.json.JSONException {\n"
+        "  Object lazy = lazy$upperfield$;\n"
+        "  if (lazy == null) {\n"
+        "    return get$upperfield$();\n"
+        "  }\n"
+        "  if (lazy instanceof org.json.JSONObject) {\n"
+        "    lazy = $javatype$.parseFromJSON((org.json.JSONObject) lazy);\n"
+        "    lazy$upperfield$ = lazy;\n"
+        "  }\n"
+        "  return ($javatype$) lazy;\n"
+        "}\n"
+        "\n"
+        "public boolean has$upperfield$Lazily() {\n"
+        "  return lazy$upperfield$ != null || has$upperfield$();\n"
+        "}\n"
+        "\n");
+  }
+
+  // One case of the key switch in a key dispatched parseFromJSON. Nulls are
+  // treated as in GenerateParseJson: scalars skip them, and maps, arrays and
+  // messages throw on them.
+  void GenerateParseJsonCase(io::Printer* printer) {
+    printer->Print(vars_, "case \"$key$\": {\n");
+    printer->Indent();
+    if (!is_map_ && !descriptor_->is_repeated() &&
+        descriptor_->type() != FieldDescriptor::TYPE_MESSAGE) {
+      printer->Print(vars_,
+          "if (json.isNull(\"$key$\")) {\n"
+          "  break;\n"
+          "}\n");
+    }
+    GenerateParseJsonValue(printer);
+    printer->Print("break;\n");
+    printer->Outdent();
+    printer->Print("}\n");
+  }
+
+  // Reads the value of the field from json into builder.
+  void GenerateParseJsonValue(io::Printer* printer) {
     if (is_map_) {
       // This is a map. Decode into an array of items.
       // Note: we assume the key is a string.
       // TODO(walt): handle dynamic key -> array.
       printer->Print(vars_,
-          "if (json.has(\"$field$\")) {\n"
-          "  org.json.JSONObject obj = json.getJSONObject(\"$field$\");\n"
-          "  java.util.Iterator<String> keys = obj.keys();\n"
-          "  while (keys.hasNext()) {\n"
-          "    $javatype$.Builder item = $javatype$.newBuilder();\n"
-          "    String key = keys.next();\n"
-          "    item.set$key_field$(key);\n"
+          "org.json.JSONObject obj = json.getJSONObject(\"$key$\");\n"
+          "java.util.Iterator<String> keys = obj.keys();\n"
+          "$javatype$.Builder item = $javatype$.acquireJSONBuilder();\n"
+          "while (keys.hasNext()) {\n"
+          "  String key = keys.next();\n"
+          "  item.clear();\n"
+          "  item.set$key_field$(key);\n"
                      );
       // TODO(walt): we don't handle repeated here yet.
       if (map_val_->type() == FieldDescriptor::TYPE_MESSAGE) {
         printer->Print(vars_,
-          "    item.set$val_field$($val_java_type$.parseFromJSON(obj.getJSONObject(key)));\n");
+          "  item.set$val_field$($val_java_type$.parseFrom$dialect$JSON(obj.getJSONObject(key)));\n");
       } else {
         printer->Print(vars_,
-          "    item.set$val_field$(obj.get$val_type$(key));\n");
+          "  item.set$val_field$(obj.get$val_type$(key));\n");
       }
       printer->Print(vars_,
-          "    builder.add$upperfield$(item.build());\n"
-          "  }\n"
+          "  builder.add$upperfield$(item.build());\n"
           "}\n"
-          "");
+          "$javatype$.releaseJSONBuilder(item);\n");
+
+    } else if (packed_) {
+      printer->Print(vars_,
+          "$javatype$[] values = $outer$.decodeJSONPacked$packed$(\n"
+          "    json.getString(\"$key$\"));\n"
+          "for (int i = 0; i < values.length; i++) {\n"
+          "  builder.add$upperfield$(values[i]);\n"
+          "}\n");
+
+    } else if (parallel_) {
+      // Large arrays go to parseJSONParallel; the anonymous parser needs the
+      // child mask in a final local.
+      printer->Print(vars_,
+          "org.json.JSONArray arr = json.getJSONArray(\"$key$\");\n"
+          "if (arr.length() >= $outer$.getParallelJSONThreshold()) {\n");
+      if (!vars_["child_mask"].empty()) {
+        printer->Print(vars_,
+            "  final $javatype$.JSONMask childMask = $child_mask$;\n");
+      }
+      printer->Print(vars_,
+          "  builder.addAll$upperfield$($outer$.parseJSONParallel(arr,\n"
+          "      new $outer$.JSONElementParser<$javatype$>() {\n"
+          "        public $javatype$ parse(org.json.JSONObject el)\n"
+          "            throws org.json.JSONException {\n"
+          "          return $javatype$.parseFrom$dialect$JSON(el$parallel_mask_arg$);\n"
+          "        }\n"
+          "      }));\n"
+          "} else {\n"
+          "  for (int i = 0; i < arr.length(); i++) {\n"
+          "    $javatype$ parsed = $javatype$.parseFrom$dialect$JSON(arr.getJSONObject(i)$child_mask_arg$);\n"
+          "    builder.add$upperfield$(parsed);\n"
+          "  }\n"
+          "}\n");
 
     } else if (descriptor_->is_repeated()) {
       printer->Print(vars_,
-          "if (json.has(\"$field$\")) {\n"
-          "  org.json.JSONArray arr = json.getJSONArray(\"$field$\");\n"
-          "  for (int i = 0; i < arr.length(); i++) {\n");
+          "org.json.JSONArray arr = json.getJSONArray(\"$key$\");\n"
+          "for (int i = 0; i < arr.length(); i++) {\n");
       if (descriptor_->type() == FieldDescriptor::TYPE_MESSAGE) {
         printer->Print(vars_,
-            "    $javatype$ parsed = $javatype$.parseFromJSON(arr.getJSONObject(i));\n"
-            "    builder.add$upperfield$(parsed);\n");
+            "  $javatype$ parsed = $javatype$.parseFrom$dialect$JSON(arr.getJSONObject(i)$child_mask_arg$);\n"
+            "  builder.add$upperfield$(parsed);\n");
       } else {
         printer->Print(vars_,
-            "    builder.add$upperfield$(arr.get$jsontype$(i));\n");
+            "  builder.add$upperfield$(arr.get$jsontype$(i));\n");
       }
-      printer->Print(
-          "  }\n"
-          "}\n");
+      printer->Print("}\n");
 
-    } else if (descriptor_->type() == FieldDescriptor::TYPE_MESSAGE) {
+    } else if (lazy_) {
+      // parseFromJSON keeps the json instead, see GenerateKeepLazy.
       printer->Print(vars_,
-          "if (json.has(\"$field$\")) {\n"
-          "  $javatype$ parsed = $javatype$.parseFromJSON(json.get$jsontype$(\"$field$\"));\n"
+          "if (!defer) {\n"
+          "  $javatype$ parsed = $javatype$.parseFromJSON(json.get$jsontype$(\"$key$\"));\n"
           "  builder.set$upperfield$(parsed);\n"
           "}\n");
 
+    } else if (descriptor_->type() == FieldDescriptor::TYPE_MESSAGE) {
+      printer->Print(vars_,
+          "$javatype$ parsed = $javatype$.parseFrom$dialect$JSON(json.get$jsontype$(\"$key$\")$child_mask_arg$);\n"
+          "builder.set$upperfield$(parsed);\n");
+
     } else if (descriptor_->type() == FieldDescriptor::TYPE_ENUM) {
       printer->Print(vars_,
-          "if (json.has(\"$field$\") && !json.isNull(\"$field$\")) {\n"
-          "  $javatype$ parsed = $javatype$.valueOf(json.get$jsontype$(\"$field$\"));\n"
-          "  if (parsed != null) {\n"
-          "    builder.set$upperfield$(parsed);\n"
-          "  }\n"
+          "$javatype$ parsed = $javatype$.valueOf(json.get$jsontype$(\"$key$\"));\n"
+          "if (parsed != null) {\n"
+          "  builder.set$upperfield$(parsed);\n"
           "}\n");
 
+    } else if (descriptor_->type() == FieldDescriptor::TYPE_FLOAT) {
+      // JSONObject doesn't have a getFloat, so get a double and cast to float
+      printer->Print(vars_,
+          "builder.set$upperfield$(($javatype$)json.get$jsontype$(\"$key$\"));\n");
+
     } else {
       // Primitive type.
-      if (descriptor_->type() == FieldDescriptor::TYPE_FLOAT) {
-        // JSONObject doesn't have a getFloat, so get a double and cast to float
-        printer->Print(vars_,
-            "if (json.has(\"$field$\") && !json.isNull(\"$field$\")) {\n"
-            "  builder.set$upperfield$(($javatype$)json.get$jsontype$(\"$field$\"));\n"
-            "}\n");
-      } else {
-        printer->Print(vars_,
-            "if (json.has(\"$field$\") && !json.isNull(\"$field$\")) {\n"
-            "  builder.set$upperfield$(json.get$jsontype$(\"$field$\"));\n"
-            "}\n");
-      }
+      printer->Print(vars_,
+          "builder.set$upperfield$(json.get$jsontype$(\"$key$\"));\n");
     }
   }
 
@@ -246,13 +787,21 @@ class FieldGenerator {
       // TODO(walt): we don't handle repeated here yet.
       if (map_val_->type() == FieldDescriptor::TYPE_MESSAGE) {
         printer->Print(vars_,
-          "    obj.put(key, el.get$val_field$().toJSON());\n");
+          "    obj.put(key, el.get$val_field$().to$dialect$JSON());\n");
       } else {
         printer->Print(vars_,
           "    obj.put(key, el.get$val_field$());\n");
       }
-      printer->Print(
+      printer->Print(vars_,
           "  }\n"
+          "  json.put(\"$key$\", obj);\n"
+          "}\n");
+
+    } else if (packed_) {
+      printer->Print(vars_,
+          "if (get$upperfield$Count() > 0) {\n"
+          "  json.put(\"$key$\",\n"
+          "      $outer$.encodeJSONPacked$packed$(get$upperfield$List()));\n"
           "}\n");
 
     } else if (descriptor_->is_repeated()) {
@@ -262,47 +811,192 @@ class FieldGenerator {
           "  for (int i = 0; i < get$upperfield$Count(); i++) {\n"
           "    $javatype$ el = get$upperfield$(i);\n");
       if (descriptor_->type() == FieldDescriptor::TYPE_MESSAGE) {
-        printer->Print("    arr.put(el.toJSON());\n");
+        printer->Print(vars_, "    arr.put(el.to$dialect$JSON($child_mask$));\n");
       } else {
         printer->Print("    arr.put(el);\n");
       }
       printer->Print(vars_,
           "  }\n"
-          "  json.put(\"$field$\", arr);\n"
+          "  json.put(\"$key$\", arr);\n"
           "}\n");
 
     } else if (descriptor_->type() == FieldDescriptor::TYPE_MESSAGE) {
       printer->Print(vars_,
-          "if (has$upperfield$()) {\n"
-          "  json.put(\"$field$\", get$upperfield$().toJSON());\n"
+          "if ($has_value$) {\n"
+          "  json.put(\"$key$\", $get_value$.to$dialect$JSON($child_mask$));\n"
           "}\n");
 
     } else if (descriptor_->type() == FieldDescriptor::TYPE_ENUM) {
       printer->Print(vars_,
           "if (has$upperfield$()) {\n"
-          "  json.put(\"$field$\", get$upperfield$().getNumber());\n"
+          "  json.put(\"$key$\", get$upperfield$().getNumber());\n"
           "}\n");
     } else {
       // Primitive type.
       printer->Print(vars_,
           "if (has$upperfield$()) {\n"
-          "  json.put(\"$field$\", get$upperfield$());\n"
+          "  json.put(\"$key$\", get$upperfield$());\n"
           "}\n");
     }
   }
 
-  // Since this field is a map, generate getMap and getKeys methods.
-  // TODO(walt): use iterable for getKeys?
-  void GenerateGetMap(io::Printer* printer) {
-    if (!is_map_) {
-      return;
+  // One case of the field name switch in the Jackson parseFromJSON. The
+  // parser is positioned on the (non-null) value of the field.
+  void GenerateParseJackson(io::Printer* printer) {
+    printer->Print(vars_, "case \"$field$\": {\n");
+    printer->Indent();
+    if (is_map_) {
+      printer->Print(vars_,
+          "if (parser.getCurrentToken() != "
+          "com.fasterxml.jackson.core.JsonToken.START_OBJECT) {\n"
+          "  throw new com.fasterxml.jackson.core.JsonParseException(\n"
+          "      parser, \"expected object for $field$\");\n"
+          "}\n"
+          "$javatype$.Builder item = $javatype$.acquireJSONBuilder();\n"
+          "while (parser.nextToken() == "
+          "com.fasterxml.jackson.core.JsonToken.FIELD_NAME) {\n"
+          "  String key = parser.getCurrentName();\n"
+          "  parser.nextToken();\n"
+          "  item.clear();\n"
+          "  item.set$key_field$(key);\n");
+      printer->Indent();
+      PrintJacksonRead(printer, map_val_,
+                       "item.set" + vars_["val_field"]);
+      printer->Outdent();
+      printer->Print(vars_,
+          "  builder.add$upperfield$(item.build());\n"
+          "}\n"
+          "$javatype$.releaseJSONBuilder(item);\n");
+
+    } else if (packed_) {
+      printer->Print(vars_,
+          "if (parser.getCurrentToken() != "
+          "com.fasterxml.jackson.core.JsonToken.VALUE_STRING) {\n"
+          "  throw new com.fasterxml.jackson.core.JsonParseException(\n"
+          "      parser, \"expected string for $field$\");\n"
+          "}\n"
+          "$javatype$[] values = $outer$.decodeJSONPacked$packed$(\n"
+          "    parser.getValueAsString());\n"
+          "for (int i = 0; i < values.length; i++) {\n"
+          "  builder.add$upperfield$(values[i]);\n"
+          "}\n");
+
+    } else if (descriptor_->is_repeated()) {
+      printer->Print(vars_,
+          "if (parser.getCurrentToken() != "
+          "com.fasterxml.jackson.core.JsonToken.START_ARRAY) {\n"
+          "  throw new com.fasterxml.jackson.core.JsonParseException(\n"
+          "      parser, \"expected array for $field$\");\n"
+          "}\n"
+          "while (parser.nextToken() != "
+          "com.fasterxml.jackson.core.JsonToken.END_ARRAY) {\n");
+      printer->Indent();
+      PrintJacksonRead(printer, descriptor_, "builder.add" + vars_["upperfield"]);
+      printer->Outdent();
+      printer->Print("}\n");
+
+    } else {
+      PrintJacksonRead(printer, descriptor_, "builder.set" + vars_["upperfield"]);
     }
+    printer->Print("break;\n");
+    printer->Outdent();
+    printer->Print("}\n");
+  }
 
+  // The json key of this field, quoted and followed by a colon.
+  void GenerateJsonKey(io::Printer* printer) {
     printer->Print(vars_,
-        "public java.util.Map<String, $val_java_type$> get$upperfield$AsMap() {\n"
-        "  java.util.Map<String, $val_java_type$> map = new java.util.HashMap<String, $val_java_type$>();\n"
-        "  for ($javatype$ x : this.get$upperfield$List()) {\n"
-        "    map.put(x.get$key_field$(), x.get$val_field$());\n"
+        "private static final String $json_key$ = \"\\\"$field$\\\":\";\n");
+  }
+
+  // Same output as GenerateToJson, but streamed into a StringBuilder "out"
+  // instead of building a JSONObject. "start" is the length of "out" just
+  // after the opening brace, used to tell whether a comma is needed.
+  void GenerateWriteJson(io::Printer* printer) {
+    if (is_map_) {
+      printer->Print(vars_,
+          "if (get$upperfield$Count() > 0) {\n"
+          "  $outer$.writeJSONKey(out, start, $json_key$);\n"
+          "  out.append('{');\n"
+          "  for (int i = 0; i < get$upperfield$Count(); i++) {\n"
+          "    $javatype$ el = get$upperfield$(i);\n"
+          "    if (i > 0) {\n"
+          "      out.append(',');\n"
+          "    }\n"
+          "    $outer$.writeJSONString(out, el.get$key_field$());\n"
+          "    out.append(':');\n");
+      printer->Indent();
+      printer->Indent();
+      printer->Print(vars_, vars_["write_val"].c_str());
+      printer->Outdent();
+      printer->Outdent();
+      printer->Print(
+          "  }\n"
+          "  out.append('}');\n"
+          "}\n");
+
+    } else if (packed_) {
+      printer->Print(vars_,
+          "if (get$upperfield$Count() > 0) {\n"
+          "  $outer$.writeJSONKey(out, start, $json_key$);\n"
+          "  $outer$.writeJSONString(\n"
+          "      out, $outer$.encodeJSONPacked$packed$(get$upperfield$List()));\n"
+          "}\n");
+
+    } else if (descriptor_->is_repeated()) {
+      printer->Print(vars_,
+          "if (get$upperfield$Count() > 0) {\n"
+          "  $outer$.writeJSONKey(out, start, $json_key$);\n"
+          "  out.append('[');\n"
+          "  for (int i = 0; i < get$upperfield$Count(); i++) {\n"
+          "    $javatype$ el = get$upperfield$(i);\n"
+          "    if (i > 0) {\n"
+          "      out.append(',');\n"
+          "    }\n");
+      printer->Indent();
+      printer->Indent();
+      printer->Print(vars_, WriteJsonValue("el", descriptor_, false).c_str());
+      printer->Outdent();
+      printer->Outdent();
+      printer->Print(
+          "  }\n"
+          "  out.append(']');\n"
+          "}\n");
+
+    } else {
+      printer->Print(vars_,
+          "if ($has_value$) {\n"
+          "  $outer$.writeJSONKey(out, start, $json_key$);\n");
+      printer->Indent();
+      printer->Print(vars_,
+          WriteJsonValue(vars_["get_value"], descriptor_, true).c_str());
+      printer->Outdent();
+      printer->Print("}\n");
+    }
+  }
+
+  // Since this field is a map, generate getMap and getKeys methods.
+  // The map is built on first use and cached on the (immutable) message, so
+  // lookups after that are hash lookups. On duplicate keys the last one wins.
+  // TODO(walt): use iterable for getKeys?
+  void GenerateGetMap(io::Printer* printer) {
+    if (!is_map_) {
+      return;
+    }
+
+    printer->Print(vars_,
+        "private volatile java.util.Map<String, $val_java_type$> $field$AsMap_;\n"
+        "\n"
+        "public java.util.Map<String, $val_java_type$> get$upperfield$AsMap() {\n"
+        "  java.util.Map<String, $val_java_type$> map = $field$AsMap_;\n"
+        "  if (map == null) {\n"
+        "    map = new java.util.HashMap<String, $val_java_type$>(\n"
+        "        get$upperfield$Count() * 4 / 3 + 1);\n"
+        "    for ($javatype$ x : this.get$upperfield$List()) {\n"
+        "      map.put(x.get$key_field$(), x.get$val_field$());\n"
+        "    }\n"
+        "    map = java.util.Collections.unmodifiableMap(map);\n"
+        "    $field$AsMap_ = map;\n"
         "  }\n"
         "  return map;\n"
         "}\n"
@@ -316,26 +1010,82 @@ class FieldGenerator {
         "}\n"
         "\n"
         "public boolean contains$upperfield$Key(String key) {\n"
-        "  for ($javatype$ x : this.get$upperfield$List()) {\n"
-        "    if (key.equals(x.get$key_field$())) {\n"
-        "      return true;\n"
-        "    }\n"
-        "  }\n"
-        "  return false;\n"
+        "  return get$upperfield$AsMap().containsKey(key);\n"
         "}\n"
         "\n"
         "public $val_java_type$ get$upperfield$Value(String key) {\n"
-        "  for ($javatype$ x : this.get$upperfield$List()) {\n"
-        "    if (key.equals(x.get$key_field$())) {\n"
-        "      return x.get$val_field$();\n"
-        "    }\n"
-        "  }\n"
-        "  return null;\n"
+        "  return get$upperfield$AsMap().get(key);\n"
         "}\n"
         "\n"
         "");
   }
 
+  // Rough size in bytes of the bytecode for field d in the plain json
+  // methods, see bytecode_size.
+  static int EstimateBytecodeSize(const FieldDescriptor* d) {
+    if (!d->options().GetExtension(dx_map_key).empty()) {
+      return 100;
+    } else if (d->is_repeated()) {
+      return 60;
+    } else if (d->type() == FieldDescriptor::TYPE_ENUM) {
+      return 45;
+    } else if (d->type() == FieldDescriptor::TYPE_MESSAGE) {
+      return 35;
+    }
+    return 30;
+  }
+
+  // Appends the field to the query string in "out", with its name after
+  // "prefix". Nested messages are flattened to dotted names, repeated fields
+  // repeat the name, the elements of repeated messages are numbered, and
+  // the entries of maps are named by their key.
+  void GenerateWriteQuery(io::Printer* printer) {
+    if (is_map_) {
+      printer->Print(vars_,
+          "for (int i = 0; i < get$upperfield$Count(); i++) {\n"
+          "  $javatype$ el = get$upperfield$(i);\n");
+      if (map_val_->type() == FieldDescriptor::TYPE_MESSAGE) {
+        printer->Print(vars_,
+            "  el.get$val_field$().writeQueryString(\n"
+            "      out, prefix + \"$field$.\" + el.get$key_field$() + \".\");\n");
+      } else {
+        printer->Print(vars_,
+            "  $outer$.writeQueryKey(out, prefix + \"$field$.\", el.get$key_field$());\n");
+        printer->Print(vars_,
+            ("  " + WriteQueryValue("el.get$val_field$()", map_val_)).c_str());
+      }
+      printer->Print("}\n");
+
+    } else if (descriptor_->is_repeated()) {
+      printer->Print(vars_,
+          "for (int i = 0; i < get$upperfield$Count(); i++) {\n");
+      if (descriptor_->type() == FieldDescriptor::TYPE_MESSAGE) {
+        printer->Print(vars_,
+            "  get$upperfield$(i).writeQueryString(out, prefix + \"$field$.\" + i + \".\");\n");
+      } else {
+        printer->Print(vars_,
+            "  $outer$.writeQueryKey(out, prefix, \"$field$\");\n");
+        printer->Print(vars_,
+            ("  " + WriteQueryValue("get$upperfield$(i)", descriptor_)).c_str());
+      }
+      printer->Print("}\n");
+
+    } else if (descriptor_->type() == FieldDescriptor::TYPE_MESSAGE) {
+      printer->Print(vars_,
+          "if ($has_value$) {\n"
+          "  $get_value$.writeQueryString(out, prefix + \"$field$.\");\n"
+          "}\n");
+
+    } else {
+      printer->Print(vars_,
+          "if (has$upperfield$()) {\n"
+          "  $outer$.writeQueryKey(out, prefix, \"$field$\");\n");
+      printer->Print(vars_,
+          ("  " + WriteQueryValue("get$upperfield$()", descriptor_)).c_str());
+      printer->Print("}\n");
+    }
+  }
+
   static bool SupportsToMap(const FieldDescriptor *d) {
     return !d->is_repeated() && d->type() != FieldDescriptor::TYPE_MESSAGE;
   }
@@ -358,123 +1108,897 @@ class FieldGenerator {
   }
 
  private:
+  // Sets the vars that differ between the variants.
+  void SetVariant(JsonVariant variant) {
+    vars_["key"] = variant == kCompactJson
+        ? compiler::SimpleItoa(descriptor_->number()) : vars_["field"];
+    vars_["dialect"] = variant == kCompactJson ? "Compact" : "";
+    // Nested messages get the part of the mask for their field.
+    vars_["child_mask"] = "";
+    vars_["child_mask_arg"] = "";
+    if (variant == kMaskedJson &&
+        descriptor_->type() == FieldDescriptor::TYPE_MESSAGE && !is_map_) {
+      vars_["child_mask"] = "(" + vars_["javatype"] +
+          ".JSONMask) mask.children[" + vars_["index"] + "]";
+      vars_["child_mask_arg"] = ", " + vars_["child_mask"];
+    }
+    vars_["parallel_mask_arg"] =
+        vars_["child_mask"].empty() ? "" : ", childMask";
+    lazy_ = lazy_field_ && variant == kPlainJson;
+  }
+
+  // Read the current token as field d and pass it to the given setter.
+  // Unknown enum numbers are dropped, as in the org.json parser.
+  void PrintJacksonRead(io::Printer* printer, const FieldDescriptor* d,
+                        const string& setter) {
+    // Without this, the getValueAs methods would return a default for an
+    // object or array and leave the parser inside it.
+    if (d->type() != FieldDescriptor::TYPE_MESSAGE) {
+      // The condition is part of the template, so that its second line is
+      // indented too.
+      printer->Print(("if (" + JacksonWrongToken(d) + ") {\n"
+          "  throw new com.fasterxml.jackson.core.JsonParseException(\n"
+          "      parser, \"expected $type$ for $field$\");\n"
+          "}\n").c_str(),
+          "type", d->cpp_type() == FieldDescriptor::CPPTYPE_STRING ? "string"
+              : d->cpp_type() == FieldDescriptor::CPPTYPE_BOOL ? "boolean"
+              : "number",
+          "field", JsonFieldName(d));
+    }
+    if (d->type() == FieldDescriptor::TYPE_ENUM) {
+      printer->Print(
+          "$javatype$ parsed = $javatype$.valueOf($read$);\n"
+          "if (parsed != null) {\n"
+          "  $setter$(parsed);\n"
+          "}\n",
+          "javatype", GetJavaType(d),
+          "read", JacksonReadValue(d, vars_["outer"]),
+          "setter", setter);
+    } else {
+      printer->Print("$setter$($read$);\n",
+                     "setter", setter,
+                     "read", JacksonReadValue(d, vars_["outer"]));
+    }
+  }
+
   const FieldDescriptor* descriptor_;
   string* error_;
   map<string, string> vars_;
   bool is_map_;
   const FieldDescriptor* map_key_;
   const FieldDescriptor* map_val_;
+  bool packed_;
+  bool parallel_;
+  bool lazy_field_;  // The field is dx_lazy.
+  bool lazy_;        // And this variant defers it.
+  int bytecode_size_;
 };
 
+// HotSpot doesn't JIT compile methods over 8000 bytes of bytecode. Since
+// field sizes are only estimated, methods are split well before that.
+static const int kMaxMethodBytecodeSize = 4000;
+
+// Messages with at least this many fields are parsed by dispatching on the
+// keys present in the json, unless dx_key_dispatch says otherwise. Payloads
+// of such messages tend to carry a few of the fields, and looking up all of
+// the others dominates the parse.
+static const int kKeyDispatchMinFields = 32;
+
+typedef void (FieldGenerator::*FieldEmitter)(io::Printer* printer);
+
 // Generate parseFrom method on a message.
 class MessageGenerator {
  public:
+  // Sets up the message for the plain json methods. The generators of the
+  // other variants, see GenerateCompact, GenerateMasked and GenerateDiff, are
+  // derived from this one.
   MessageGenerator(const Descriptor* descriptor,
+                   const GeneratorOptions& options,
                    string* error)
-      : descriptor_(descriptor), error_(error) {
+      : descriptor_(descriptor), options_(options), error_(error),
+        variant_(kPlainJson), has_lazy_fields_(false), lazy_(false) {
     vars_["classname"] = java::ClassName(descriptor_);
+    // Set up each field once; every method below, of every variant, uses
+    // these.
+    fields_.reserve(descriptor_->field_count());
+    for (int i = 0; i < descriptor_->field_count(); i++) {
+      fields_.push_back(FieldGenerator(descriptor_->field(i), error_));
+      has_lazy_fields_ |= fields_.back().is_lazy();
+    }
+    SetVariant();
+  }
+
+  // Splits fields of the given sizes into chunks whose code fits in one
+  // method. chunks gets the index of the first field of each chunk, followed
+  // by the number of fields.
+  static void ComputeChunks(const vector<int>& sizes, vector<int>* chunks) {
+    chunks->push_back(0);
+    int size = 0;
+    for (int i = 0; i < sizes.size(); i++) {
+      if (size > 0 && size + sizes[i] > kMaxMethodBytecodeSize) {
+        chunks->push_back(i);
+        size = 0;
+      }
+      size += sizes[i];
+    }
+    chunks->push_back(sizes.size());
+  }
+
+  // Whether the generated methods of the message are split into helpers.
+  static bool IsSplit(const Descriptor* d, const GeneratorOptions& options) {
+    vector<int> sizes;
+    for (int i = 0; i < d->field_count(); i++) {
+      int size = FieldGenerator::EstimateBytecodeSize(d->field(i));
+      sizes.push_back(options.json_diff ? 2 * size : size);
+    }
+    vector<int> chunks;
+    ComputeChunks(sizes, &chunks);
+    return chunks.size() > 2;
+  }
+
+  // Whether parseFromJSON(org.json.JSONObject) dispatches on the keys of the
+  // json, rather than looking up each field.
+  static bool UsesKeyDispatch(const Descriptor* d) {
+    if (d->options().HasExtension(dx_key_dispatch)) {
+      return d->options().GetExtension(dx_key_dispatch);
+    }
+    return d->field_count() >= kKeyDispatchMinFields;
+  }
+
+  // Whether d, or a message it contains at any depth, has a dx_lazy field.
+  // toJSONDiff compares such messages with equals, which doesn't see a field
+  // kept as json by parseFromJSON.
+  static bool ReachesLazyField(const Descriptor* d,
+                               set<const Descriptor*>* seen) {
+    if (!seen->insert(d).second) {
+      return false;
+    }
+    string ignored;
+    for (int i = 0; i < d->field_count(); i++) {
+      const FieldDescriptor* field = d->field(i);
+      if (IsLazyField(field, &ignored) ||
+          (field->message_type() != NULL &&
+           ReachesLazyField(field->message_type(), seen))) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Whether the message has the methods of the compact dialect.
+  static bool IsCompact(const Descriptor* d) {
+    return d->options().GetExtension(dx_compact);
   }
 
   void GenerateSource(io::Printer* printer) {
     GenerateGetMap(printer);
     printer->Print("\n");
+    for (int i = 0; i < descriptor_->field_count(); i++) {
+      fields_[i].GenerateLazyAccessors(printer);
+    }
+    if (lazy_) {
+      GenerateMaterialize(printer);
+      printer->Print("\n");
+    }
+    GenerateBuilderPool(printer);
+    printer->Print("\n");
     GenerateParseJson(printer);
     printer->Print("\n");
+    if (options_.jackson) {
+      GenerateParseJackson(printer);
+      printer->Print("\n");
+    }
     GenerateToJson(printer);
     printer->Print("\n");
+    GenerateWriteJson(printer);
+    printer->Print("\n");
     GenerateToMap(printer);
     printer->Print("\n");
+    if (options_.query_string) {
+      GenerateWriteQuery(printer);
+      printer->Print("\n");
+    }
+    if (IsCompact(descriptor_)) {
+      ForVariant(kCompactJson).GenerateCompact(printer);
+    }
+    if (options_.field_masks) {
+      ForVariant(kMaskedJson).GenerateMasked(printer);
+    }
+    if (options_.json_diff) {
+      if (ReachesLazyField()) {
+        error_->assign("json_diff=true can't be used with message " +
+                       descriptor_->full_name() +
+                       ", which has or contains a dx_lazy field");
+      }
+      ForVariant(kDiffJson).GenerateDiff(printer);
+    }
   }
 
  private:
-  // parseFromJSON method.
-  void GenerateParseJson(io::Printer* printer) {
-    printer->Print(vars_,
-        "public static $classname$ parseFromJSON("
-        "org.json.JSONObject json) throws org.json.JSONException {\n");
-    printer->Indent();
-    printer->Print(vars_,
-        "$classname$.Builder builder = $classname$.newBuilder();\n");
+  // ReachesLazyField for this message, using what its fields already know.
+  bool ReachesLazyField() const {
+    if (has_lazy_fields_) {
+      return true;
+    }
+    set<const Descriptor*> seen;
+    seen.insert(descriptor_);
     for (int i = 0; i < descriptor_->field_count(); i++) {
-      FieldGenerator(descriptor_->field(i), error_).GenerateParseJson(printer);
+      const Descriptor* type = descriptor_->field(i)->message_type();
+      if (type != NULL && ReachesLazyField(type, &seen)) {
+        return true;
+      }
     }
-    printer->Print("return builder.build();\n");
-    printer->Outdent();
-    printer->Print("}\n");
+    return false;
   }
 
-  // toJSON method.
-  void GenerateToJson(io::Printer* printer) {
-    printer->Print(
-        "public org.json.JSONObject toJSON() throws org.json.JSONException {\n"
-        "  org.json.JSONObject json = new org.json.JSONObject();\n");
-    printer->Indent();
+  // A copy of this generator, and of its fields, for the given variant.
+  MessageGenerator ForVariant(JsonVariant variant) const {
+    MessageGenerator copy(*this);
+    copy.variant_ = variant;
+    for (int i = 0; i < copy.fields_.size(); i++) {
+      copy.fields_[i] = fields_[i].ForVariant(variant);
+    }
+    copy.SetVariant();
+    return copy;
+  }
+
+  // Sets the vars and chunks that differ between the variants.
+  void SetVariant() {
+    vars_["dialect"] = variant_ == kCompactJson ? "Compact" : "";
+    if (variant_ == kDiffJson) {
+      vars_["merge_method"] = "applyJSONDiff";
+      vars_["merge_part"] = "applyJSONDiffPart";
+    } else {
+      vars_["merge_method"] = "mergeFrom" + vars_["dialect"] + "JSON";
+      vars_["merge_part"] = "parseFrom" + vars_["dialect"] + "JSONPart";
+    }
+    vars_["mask_decl"] = "";
+    vars_["mask_param"] = "";
+    vars_["mask_arg"] = "";
+    if (variant_ == kMaskedJson) {
+      vars_["mask_decl"] = vars_["classname"] + ".JSONMask mask";
+      vars_["mask_param"] = ", " + vars_["mask_decl"];
+      vars_["mask_arg"] = ", mask";
+    }
+    // With dx_lazy fields, the plain mergeFromJSON and its helpers take
+    // whether to skip them, which parseFromJSON does.
+    lazy_ = variant_ == kPlainJson && has_lazy_fields_;
+    vars_["merge_access"] = lazy_ ? "private" : "public";
+    vars_["defer_param"] = lazy_ ? ", boolean defer" : "";
+    vars_["defer_arg"] = lazy_ ? ", defer" : "";
+    vector<int> sizes;
+    for (int i = 0; i < fields_.size(); i++) {
+      sizes.push_back(fields_[i].bytecode_size(variant_));
+    }
+    chunks_.clear();
+    ComputeChunks(sizes, &chunks_);
+  }
+
+  // parseFromCompactJSON, mergeFromCompactJSON and toCompactJSON: the same
+  // json, except that the keys are field numbers, which makes lists of
+  // messages much smaller. Parsing always dispatches on the keys present.
+  void GenerateCompact(io::Printer* printer) {
     for (int i = 0; i < descriptor_->field_count(); i++) {
-      FieldGenerator(descriptor_->field(i), error_).GenerateToJson(printer);
+      const FieldDescriptor* field = descriptor_->field(i);
+      const FieldDescriptor* key;
+      const FieldDescriptor* val;
+      if (GetMapFields(field, &key, &val, error_) && val != NULL) {
+        field = val;
+      }
+      if (field->message_type() != NULL && !IsCompact(field->message_type())) {
+        error_->assign("dx_compact message " + descriptor_->full_name() +
+                       " uses " + field->message_type()->full_name() +
+                       ", which isn't dx_compact");
+      }
     }
+    GenerateParseJson(printer);
+    printer->Print("\n");
+    GenerateToJson(printer);
+    printer->Print("\n");
+  }
+
+  // The JSONMask class, parseFromJSON(json, mask), mergeFromJSON(json,
+  // builder, mask) and toJSON(mask). Nested messages are masked by the
+  // sub-mask of their field; maps are always whole.
+  void GenerateMasked(io::Printer* printer) {
+    GenerateJsonMask(printer);
+    printer->Print("\n");
+    GenerateParseJson(printer);
+    printer->Print("\n");
+    GenerateToJson(printer);
+    printer->Print("\n");
+  }
+
+  // toJSONDiff(previous), and applyJSONDiff(json, builder), which turns
+  // previous into the message when given its diff. Like compact parsing,
+  // applying dispatches on the keys present; diffs are usually small.
+  void GenerateDiff(io::Printer* printer) {
+    printer->Print(vars_,
+        "public org.json.JSONObject toJSONDiff($classname$ previous)\n"
+        "    throws org.json.JSONException {\n"
+        "  org.json.JSONObject json = new org.json.JSONObject();\n");
+    printer->Indent();
+    GenerateFields(printer, &FieldGenerator::GenerateToJsonDiff,
+                   "toJSONDiffPart$n$(json, previous);\n");
     printer->Print("return json;\n");
     printer->Outdent();
     printer->Print("}\n");
+    GenerateFieldHelpers(printer, &FieldGenerator::GenerateToJsonDiff,
+        "private void toJSONDiffPart$n$(org.json.JSONObject json,\n"
+        "    $classname$ previous) throws org.json.JSONException {\n",
+        "}\n");
+    printer->Print("\n");
+    GenerateMergeJsonByKey(printer);
+    printer->Print("\n");
   }
 
-  // toMap method.
-  void GenerateToMap(io::Printer* printer) {
-    bool supported = true;
-    for (int i = 0; i < descriptor_->field_count(); i++) {
-      supported &= FieldGenerator::SupportsToMap(descriptor_->field(i));
-    }
-
-    if (supported) {
-      printer->Print("public java.util.Map<String,?> toMap() {\n");
-      printer->Indent();
+  void GenerateJsonMask(io::Printer* printer) {
+    map<string, string> vars = vars_;
+    vars["words"] = compiler::SimpleItoa((descriptor_->field_count() + 63) / 64);
+    vars["fields"] = compiler::SimpleItoa(descriptor_->field_count());
+    printer->Print(vars,
+        "// The fields written by toJSON(mask) and read by parseFromJSON(json,\n"
+        "// mask). Paths are dotted json field names; a path to a message field\n"
+        "// selects all of it, a longer one only the named part.\n"
+        "public static final class JSONMask {\n"
+        "  final long[] bits = new long[$words$];\n"
+        "  final Object[] children = new Object[$fields$];\n"
+        "\n"
+        "  public static JSONMask compile(String... paths) {\n"
+        "    JSONMask mask = new JSONMask();\n"
+        "    for (String path : paths) {\n"
+        "      mask.add(path);\n"
+        "    }\n"
+        "    return mask;\n"
+        "  }\n"
+        "\n"
+        "  void add(String path) {\n");
+    printer->Indent();
+    printer->Indent();
+    if (descriptor_->field_count() == 0) {
       printer->Print(vars_,
-          "java.util.Map<String, String> m = "
-          "new java.util.HashMap<String, String>();\n");
+          "throw new IllegalArgumentException(\n"
+          "    \"unknown field \" + path + \" of $classname$\");\n");
+    } else {
+      printer->Print(vars_,
+          "int dot = path.indexOf('.');\n"
+          "String name = dot < 0 ? path : path.substring(0, dot);\n"
+          "String rest = dot < 0 ? null : path.substring(dot + 1);\n"
+          "int index;\n"
+          "switch (name) {\n");
+      printer->Indent();
       for (int i = 0; i < descriptor_->field_count(); i++) {
-        FieldGenerator(descriptor_->field(i), error_).GenerateToMap(printer);
+        fields_[i].GenerateMaskCase(printer);
       }
-      printer->Print("return m;\n");
+      printer->Print(vars_,
+          "default:\n"
+          "  throw new IllegalArgumentException(\n"
+          "      \"unknown field \" + name + \" of $classname$\");\n");
       printer->Outdent();
-      printer->Print("}\n");
+      printer->Print(vars_,
+          "}\n"
+          "if (rest != null) {\n"
+          "  throw new IllegalArgumentException(\n"
+          "      \"field \" + name + \" of $classname$ isn't a message\");\n"
+          "}\n"
+          "bits[index / 64] |= 1L << index;\n"
+          "children[index] = null;\n");
     }
+    printer->Outdent();
+    printer->Outdent();
+    printer->Print(
+        "  }\n"
+        "}\n");
   }
 
-  // getMap method for fields that are maps.
-  void GenerateGetMap(io::Printer* printer) {
-    for (int i = 0; i < descriptor_->field_count(); i++) {
-      FieldGenerator(descriptor_->field(i), error_).GenerateGetMap(printer);
+  // Emits the code of all fields: inline, or for large messages as calls to
+  // the helper methods emitted by GenerateFieldHelpers.
+  void GenerateFields(io::Printer* printer, FieldEmitter emit,
+                      const char* call) {
+    if (chunks_.size() == 2) {
+      for (int i = 0; i < descriptor_->field_count(); i++) {
+        (fields_[i].*emit)(printer);
+      }
+      return;
+    }
+    map<string, string> vars = vars_;
+    for (int c = 0; c + 1 < chunks_.size(); c++) {
+      vars["n"] = compiler::SimpleItoa(c);
+      printer->Print(vars, call);
     }
   }
 
-  const Descriptor* descriptor_;
-  string* error_;
-  map<string, string> vars_;
-};
-
+  // For large messages, the helper methods called by GenerateFields; each
+  // gets the code of one chunk of fields between header and footer, indented
+  // depth levels.
+  void GenerateFieldHelpers(io::Printer* printer, FieldEmitter emit,
+                            const char* header, const char* footer,
+                            int depth = 1) {
+    if (chunks_.size() == 2) {
+      return;
+    }
+    map<string, string> vars = vars_;
+    for (int c = 0; c + 1 < chunks_.size(); c++) {
+      vars["n"] = compiler::SimpleItoa(c);
+      printer->Print("\n");
+      printer->Print(vars, header);
+      for (int i = 0; i < depth; i++) {
+        printer->Indent();
+      }
+      for (int i = chunks_[c]; i < chunks_[c + 1]; i++) {
+        (fields_[i].*emit)(printer);
+      }
+      for (int i = 0; i < depth; i++) {
+        printer->Outdent();
+      }
+      printer->Print(footer);
+    }
+  }
 
-// Generate one method on a service.
-class MethodGenerator {
- public:
-  MethodGenerator(const MethodDescriptor* descriptor, string* error)
-      : descriptor_(descriptor), error_(error) {
-    DXMethodOptions options =
-        descriptor_->options().GetExtension(dx_method_options);
-    vars_["method_name"] = descriptor->name();
-    vars_["input_class"] = java::ClassName(descriptor->input_type());
-    vars_["output_class"] = java::ClassName(descriptor->output_type());
-    vars_["http_method"] = options.http_method();
+  // Per thread pool of builders, used by parseFromJSON and for map entries so
+  // that parsing in a loop doesn't allocate builders. It is a pool rather
+  // than a single builder because messages may nest messages of their own
+  // type. Builders lost to exceptions are simply not returned.
+  void GenerateBuilderPool(io::Printer* printer) {
+    printer->Print(vars_,
+        "private static final ThreadLocal<java.util.ArrayList<$classname$.Builder>> "
+        "JSON_BUILDERS =\n"
+        "    new ThreadLocal<java.util.ArrayList<$classname$.Builder>>() {\n"
+        "      @Override\n"
+        "      protected java.util.ArrayList<$classname$.Builder> initialValue() {\n"
+        "        return new java.util.ArrayList<$classname$.Builder>();\n"
+        "      }\n"
+        "    };\n"
+        "\n"
+        "public static $classname$.Builder acquireJSONBuilder() {\n"
+        "  java.util.ArrayList<$classname$.Builder> free = JSON_BUILDERS.get();\n"
+        "  if (free.isEmpty()) {\n"
+        "    return $classname$.newBuilder();\n"
+        "  }\n"
+        "  return free.remove(free.size() - 1);\n"
+        "}\n"
+        "\n"
+        "public static void releaseJSONBuilder($classname$.Builder builder) {\n"
+        "  builder.clear();\n"
+        "  JSON_BUILDERS.get().add(builder);\n"
+        "}\n");
   }
 
-  void GenerateSource(io::Printer* printer) {
-    if (!descriptor_->options().HasExtension(dx_method_options)) {
-      error_->assign("Error: can't generate method %s, "
-                     "doesn't have options set");
-      return;
+  // materializeJSON, which sets the dx_lazy fields deferred by parseFromJSON.
+  // toBuilder(), equals, hashCode and the binary encoding are generated by
+  // protoc and only see fields that are set.
+  void GenerateMaterialize(io::Printer* printer) {
+    printer->Print(vars_,
+        "public $classname$ materializeJSON() throws org.json.JSONException {\n"
+        "  $classname$.Builder builder = null;\n");
+    printer->Indent();
+    for (int i = 0; i < descriptor_->field_count(); i++) {
+      fields_[i].GenerateMaterializeLazy(printer);
     }
+    printer->Print("return builder == null ? this : builder.build();\n");
+    printer->Outdent();
+    printer->Print("}\n");
+  }
 
-    //fprintf(stderr, "doing method %s\n", descriptor_->DebugString().c_str());
-    DXMethodOptions options =
-        descriptor_->options().GetExtension(dx_method_options);
+  // parseFromJSON, which merges into a pooled builder, and mergeFromJSON.
+  void GenerateParseJson(io::Printer* printer) {
+    printer->Print(vars_,
+        "public static $classname$ parseFrom$dialect$JSON("
+        "org.json.JSONObject json$mask_param$) throws org.json.JSONException {\n"
+        "  $classname$.Builder builder = acquireJSONBuilder();\n");
+    if (lazy_) {
+      printer->Print(
+          "  mergeFromJSON(json, builder, true);\n"
+          "  $classname$ result = builder.build();\n"
+          "  releaseJSONBuilder(builder);\n",
+          "classname", vars_["classname"]);
+      printer->Indent();
+      for (int i = 0; i < descriptor_->field_count(); i++) {
+        fields_[i].GenerateKeepLazy(printer);
+      }
+      printer->Outdent();
+      printer->Print(
+          "  return result;\n"
+          "}\n"
+          "\n");
+      printer->Print(vars_,
+          "public static void mergeFromJSON(org.json.JSONObject json,\n"
+          "    $classname$.Builder builder) throws org.json.JSONException {\n"
+          "  mergeFromJSON(json, builder, false);\n"
+          "}\n"
+          "\n");
+    } else {
+      printer->Print(vars_,
+          "  mergeFrom$dialect$JSON(json, builder$mask_arg$);\n"
+          "  $classname$ result = builder.build();\n"
+          "  releaseJSONBuilder(builder);\n"
+          "  return result;\n"
+          "}\n"
+          "\n");
+    }
+    if (variant_ == kCompactJson ||
+        (variant_ == kPlainJson && UsesKeyDispatch(descriptor_))) {
+      GenerateMergeJsonByKey(printer);
+      return;
+    }
+    FieldEmitter emit = variant_ == kMaskedJson
+        ? &FieldGenerator::GenerateMaskedParseJson
+        : &FieldGenerator::GenerateParseJson;
+    printer->Print(vars_,
+        "$merge_access$ static void mergeFromJSON(org.json.JSONObject json,\n"
+        "    $classname$.Builder builder$mask_param$$defer_param$) throws org.json.JSONException {\n");
+    printer->Indent();
+    if (variant_ == kMaskedJson) {
+      printer->Print(
+          "if (mask == null) {\n"
+          "  mergeFromJSON(json, builder);\n"
+          "  return;\n"
+          "}\n");
+    }
+    GenerateFields(printer, emit,
+                   "parseFromJSONPart$n$(json, builder$mask_arg$$defer_arg$);\n");
+    printer->Outdent();
+    printer->Print("}\n");
+    GenerateFieldHelpers(printer, emit,
+        "private static void parseFromJSONPart$n$(\n"
+        "    org.json.JSONObject json, $classname$.Builder builder$mask_param$$defer_param$)\n"
+        "    throws org.json.JSONException {\n",
+        "}\n");
+  }
+
+  // mergeFromJSON method that iterates over the keys of the json object, so
+  // its cost is in the number of fields present rather than declared. Unknown
+  // keys are skipped; nulls are handled by each case.
+  void GenerateMergeJsonByKey(io::Printer* printer) {
+    FieldEmitter emit = variant_ == kDiffJson
+        ? &FieldGenerator::GenerateApplyJsonDiffCase
+        : &FieldGenerator::GenerateParseJsonCase;
+    printer->Print(vars_,
+        "$merge_access$ static void $merge_method$(org.json.JSONObject json,\n"
+        "    $classname$.Builder builder$defer_param$) throws org.json.JSONException {\n"
+        "  java.util.Iterator<?> names = json.keys();\n"
+        "  while (names.hasNext()) {\n"
+        "    String name = (String) names.next();\n");
+    printer->Indent();
+    printer->Indent();
+    if (chunks_.size() == 2) {
+      printer->Print("switch (name) {\n");
+      printer->Indent();
+      for (int i = 0; i < descriptor_->field_count(); i++) {
+        (fields_[i].*emit)(printer);
+      }
+      printer->Print(
+          "default:\n"
+          "  break;\n");
+      printer->Outdent();
+      printer->Print("}\n");
+    } else {
+      // As in the Jackson parseFromJSON, each helper returns false for keys
+      // that aren't its fields.
+      map<string, string> vars = vars_;
+      for (int c = 0; c + 2 < chunks_.size(); c++) {
+        vars["n"] = compiler::SimpleItoa(c);
+        printer->Print(vars,
+            "if ($merge_part$$n$(json, builder, name$defer_arg$)) {\n"
+            "  continue;\n"
+            "}\n");
+      }
+      vars["n"] = compiler::SimpleItoa(chunks_.size() - 2);
+      printer->Print(vars, "$merge_part$$n$(json, builder, name$defer_arg$);\n");
+    }
+    printer->Outdent();
+    printer->Outdent();
+    printer->Print(
+        "  }\n"
+        "}\n");
+    GenerateFieldHelpers(printer, emit,
+        "private static boolean $merge_part$$n$(\n"
+        "    org.json.JSONObject json, $classname$.Builder builder, String name$defer_param$)\n"
+        "    throws org.json.JSONException {\n"
+        "  switch (name) {\n",
+        "    default:\n"
+        "      return false;\n"
+        "  }\n"
+        "  return true;\n"
+        "}\n", 2);
+  }
+
+  // parseFromJSON and mergeFromJSON methods reading from a Jackson token
+  // stream, in one pass and without building a tree. Fields are dispatched on
+  // their name; unknown fields and nulls are skipped.
+  void GenerateParseJackson(io::Printer* printer) {
+    printer->Print(vars_,
+        "public static $classname$ parseFromJSON(\n"
+        "    com.fasterxml.jackson.core.JsonParser parser)\n"
+        "    throws java.io.IOException {\n"
+        "  $classname$.Builder builder = acquireJSONBuilder();\n"
+        "  mergeFromJSON(parser, builder);\n"
+        "  $classname$ result = builder.build();\n"
+        "  releaseJSONBuilder(builder);\n"
+        "  return result;\n"
+        "}\n"
+        "\n"
+        "public static void mergeFromJSON(\n"
+        "    com.fasterxml.jackson.core.JsonParser parser,\n"
+        "    $classname$.Builder builder) throws java.io.IOException {\n");
+    printer->Indent();
+    printer->Print(vars_,
+        "if (parser.getCurrentToken() == null) {\n"
+        "  parser.nextToken();\n"
+        "}\n"
+        "if (parser.getCurrentToken() != "
+        "com.fasterxml.jackson.core.JsonToken.START_OBJECT) {\n"
+        "  throw new com.fasterxml.jackson.core.JsonParseException(\n"
+        "      parser, \"expected object for $classname$\");\n"
+        "}\n"
+        "while (parser.nextToken() == "
+        "com.fasterxml.jackson.core.JsonToken.FIELD_NAME) {\n"
+        "  String field = parser.getCurrentName();\n"
+        "  if (parser.nextToken() == "
+        "com.fasterxml.jackson.core.JsonToken.VALUE_NULL) {\n"
+        "    continue;\n"
+        "  }\n"
+        "");
+    printer->Indent();
+    if (chunks_.size() == 2) {
+      printer->Print("switch (field) {\n");
+      printer->Indent();
+      for (int i = 0; i < descriptor_->field_count(); i++) {
+        fields_[i].GenerateParseJackson(printer);
+      }
+      printer->Print(
+          "default:\n"
+          "  parser.skipChildren();\n"
+          "  break;\n");
+      printer->Outdent();
+      printer->Print("}\n");
+    } else {
+      // Each helper has a switch over its own fields, and returns false if
+      // the field isn't one of them.
+      for (int c = 0; c + 1 < chunks_.size(); c++) {
+        printer->Print(c == 0 ? "if (" : "    ");
+        printer->Print("!parseFromJSONPart$n$(parser, builder, field)",
+                       "n", compiler::SimpleItoa(c));
+        printer->Print(c + 2 < chunks_.size() ? " &&\n" : ") {\n");
+      }
+      printer->Print(
+          "  parser.skipChildren();\n"
+          "}\n");
+    }
+    printer->Outdent();
+    printer->Print("}\n");
+    printer->Outdent();
+    printer->Print("}\n");
+    GenerateFieldHelpers(printer, &FieldGenerator::GenerateParseJackson,
+        "private static boolean parseFromJSONPart$n$(\n"
+        "    com.fasterxml.jackson.core.JsonParser parser,\n"
+        "    $classname$.Builder builder, String field)\n"
+        "    throws java.io.IOException {\n"
+        "  switch (field) {\n",
+        "    default:\n"
+        "      return false;\n"
+        "  }\n"
+        "  return true;\n"
+        "}\n", 2);
+  }
+
+  // toJSON method.
+  void GenerateToJson(io::Printer* printer) {
+    printer->Print(vars_,
+        "public org.json.JSONObject to$dialect$JSON($mask_decl$) "
+        "throws org.json.JSONException {\n");
+    printer->Indent();
+    if (variant_ == kMaskedJson) {
+      printer->Print(
+          "if (mask == null) {\n"
+          "  return toJSON();\n"
+          "}\n");
+    }
+    printer->Print("org.json.JSONObject json = new org.json.JSONObject();\n");
+    FieldEmitter emit = variant_ == kMaskedJson
+        ? &FieldGenerator::GenerateMaskedToJson
+        : &FieldGenerator::GenerateToJson;
+    GenerateFields(printer, emit, "to$dialect$JSONPart$n$(json$mask_arg$);\n");
+    printer->Print("return json;\n");
+    printer->Outdent();
+    printer->Print("}\n");
+    GenerateFieldHelpers(printer, emit,
+        "private void to$dialect$JSONPart$n$(org.json.JSONObject json$mask_param$)\n"
+        "    throws org.json.JSONException {\n",
+        "}\n");
+  }
+
+  // writeJSON method, plus the pre-encoded keys it uses.
+  void GenerateWriteJson(io::Printer* printer) {
+    for (int i = 0; i < descriptor_->field_count(); i++) {
+      fields_[i].GenerateJsonKey(printer);
+    }
+    printer->Print(
+        "\n"
+        "public void writeJSON(java.lang.StringBuilder out) "
+        "throws org.json.JSONException {\n"
+        "  out.append('{');\n"
+        "  final int start = out.length();\n");
+    printer->Indent();
+    GenerateFields(printer, &FieldGenerator::GenerateWriteJson,
+                   "writeJSONPart$n$(out, start);\n");
+    printer->Print("out.append('}');\n");
+    printer->Outdent();
+    printer->Print("}\n");
+    GenerateFieldHelpers(printer, &FieldGenerator::GenerateWriteJson,
+        "private void writeJSONPart$n$(java.lang.StringBuilder out, int start)\n"
+        "    throws org.json.JSONException {\n",
+        "}\n");
+  }
+
+  // writeQueryString methods.
+  void GenerateWriteQuery(io::Printer* printer) {
+    printer->Print(
+        "public void writeQueryString(java.lang.StringBuilder out)\n"
+        "    throws org.json.JSONException {\n"
+        "  writeQueryString(out, \"\");\n"
+        "}\n"
+        "\n"
+        "public void writeQueryString(java.lang.StringBuilder out, String prefix)\n"
+        "    throws org.json.JSONException {\n");
+    printer->Indent();
+    GenerateFields(printer, &FieldGenerator::GenerateWriteQuery,
+                   "writeQueryStringPart$n$(out, prefix);\n");
+    printer->Outdent();
+    printer->Print("}\n");
+    GenerateFieldHelpers(printer, &FieldGenerator::GenerateWriteQuery,
+        "private void writeQueryStringPart$n$(java.lang.StringBuilder out,\n"
+        "    String prefix) throws org.json.JSONException {\n",
+        "}\n");
+  }
+
+  // toMap method.
+  void GenerateToMap(io::Printer* printer) {
+    bool supported = true;
+    for (int i = 0; i < descriptor_->field_count(); i++) {
+      supported &= FieldGenerator::SupportsToMap(descriptor_->field(i));
+    }
+
+    if (supported) {
+      printer->Print("public java.util.Map<String,?> toMap() {\n");
+      printer->Indent();
+      printer->Print(vars_,
+          "java.util.Map<String, String> m = "
+          "new java.util.HashMap<String, String>();\n");
+      GenerateFields(printer, &FieldGenerator::GenerateToMap,
+                     "toMapPart$n$(m);\n");
+      printer->Print("return m;\n");
+      printer->Outdent();
+      printer->Print("}\n");
+      GenerateFieldHelpers(printer, &FieldGenerator::GenerateToMap,
+          "private void toMapPart$n$(java.util.Map<String, String> m) {\n",
+          "}\n");
+    }
+  }
+
+  // getMap method for fields that are maps.
+  void GenerateGetMap(io::Printer* printer) {
+    for (int i = 0; i < descriptor_->field_count(); i++) {
+      fields_[i].GenerateGetMap(printer);
+    }
+  }
+
+  const Descriptor* descriptor_;
+  const GeneratorOptions& options_;
+  string* error_;
+  map<string, string> vars_;
+  JsonVariant variant_;
+  bool has_lazy_fields_;
+  bool lazy_;
+  vector<FieldGenerator> fields_;
+  vector<int> chunks_;
+};
+
+
+// The parts of the transport hooks that depend on bytes_transport.
+static void SetTransportVars(const GeneratorOptions& options,
+                             map<string, string>* vars) {
+  if (options.bytes_transport) {
+    (*vars)["request_type"] = "byte[]";
+    (*vars)["response_type"] = "ResponseDecoder<T>";
+    (*vars)["response_arg"] = "decoder";
+    (*vars)["params_key"] = "(params == null ? \"\" : new String(params, JSON_UTF8))";
+    // The decoder measures the response itself, see GenerateMetrics.
+    (*vars)["stats_param"] = "";
+    (*vars)["stats_arg"] = "";
+  } else {
+    (*vars)["request_type"] = "org.json.JSONObject";
+    (*vars)["response_type"] = "Class<T>";
+    (*vars)["response_arg"] = "responseType";
+    (*vars)["params_key"] = "params";
+    (*vars)["stats_param"] = "    final CallStats stats,\n";
+    (*vars)["stats_arg"] = "stats, ";
+  }
+}
+
+// Generate one method on a service.
+class MethodGenerator {
+ public:
+  MethodGenerator(const MethodDescriptor* descriptor,
+                  const GeneratorOptions& generator_options, string* error)
+      : descriptor_(descriptor), options_(generator_options), error_(error) {
+    DXMethodOptions options =
+        descriptor_->options().GetExtension(dx_method_options);
+    vars_["method_name"] = descriptor->name();
+    vars_["input_class"] = java::ClassName(descriptor->input_type());
+    vars_["output_class"] = java::ClassName(descriptor->output_type());
+    vars_["http_method"] = options.http_method();
+    vars_["dialect"] = options.compact() ? "Compact" : "";
+    vars_["call"] = options.coalesce() ? "coalescedCall"
+                                       : "do" + vars_["dialect"] + "Call";
+    vars_["response"] = options_.bytes_transport
+        ? descriptor->name() + "Decoder" : vars_["output_class"] + ".class";
+    SetTransportVars(options_, &vars_);
+    vars_["hedge"] = "";
+    if (options.hedge_after_ms() > 0) {
+      vars_["call"] = "hedgedCall";
+      vars_["hedge"] = compiler::SimpleItoa(options.hedge_after_ms()) + ", ";
+    }
+    // Streaming methods deliver the elements of the response one at a time.
+    if (descriptor->server_streaming()) {
+      vars_["callback_type"] = "StreamCallback<" + vars_["output_class"] + ">";
+      vars_["no_response"] = "";
+    } else {
+      vars_["callback_type"] = "Callback<" + vars_["output_class"] + ">";
+      vars_["no_response"] = ", null";
+    }
+  }
+
+  void GenerateSource(io::Printer* printer) {
+    if (!descriptor_->options().HasExtension(dx_method_options)) {
+      error_->assign("Error: can't generate method %s, "
+                     "doesn't have options set");
+      return;
+    }
+
+    //fprintf(stderr, "doing method %s\n", descriptor_->DebugString().c_str());
+    DXMethodOptions options =
+        descriptor_->options().GetExtension(dx_method_options);
+    if (options.compact() &&
+        (!MessageGenerator::IsCompact(descriptor_->input_type()) ||
+         !MessageGenerator::IsCompact(descriptor_->output_type()))) {
+      error_->assign("compact method " + descriptor_->full_name() +
+                     " needs dx_compact input and output messages");
+      return;
+    }
+    if (descriptor_->client_streaming() ||
+        (descriptor_->server_streaming() && options.compact())) {
+      error_->assign("method " + descriptor_->full_name() + " can't be "
+                     "client streaming, or server streaming and compact");
+      return;
+    }
+    if (options.hedge_after_ms() > 0 &&
+        (options.compact() || options.coalesce() ||
+         descriptor_->server_streaming())) {
+      error_->assign("hedged method " + descriptor_->full_name() +
+                     " can't be compact, coalesced or streaming");
+      return;
+    }
+    if (options.cache_ttl_ms() > 0 && descriptor_->server_streaming()) {
+      error_->assign("cached method " + descriptor_->full_name() +
+                     " can't be streaming");
+      return;
+    }
+    if (options.coalesce() &&
+        (options.compact() || descriptor_->server_streaming())) {
+      error_->assign("coalesced method " + descriptor_->full_name() +
+                     " can't be compact or streaming");
+      return;
+    }
+    if (options.diff() &&
+        (options.compact() || options.coalesce() ||
+         options.hedge_after_ms() > 0 || options.cache_ttl_ms() > 0 ||
+         !options_.json_diff)) {
+      error_->assign("diff method " + descriptor_->full_name() +
+                     " needs json_diff=true, and can't be compact, "
+                     "coalesced, hedged or cached");
+      return;
+    }
 
     // Pull out all args from the path, we'll use them as the first arguments to
     // this method. The args are specified like express.js.
@@ -496,13 +2020,42 @@ class MethodGenerator {
       }
     }
 
-    printer->Print(vars_, "public void $method_name$(");
-    for (int i = 0; i < method_args.size(); i++) {
-      printer->Print("String $v$, ", "v", method_args[i]);
+    if (options_.bytes_transport && !descriptor_->server_streaming()) {
+      GenerateDecoder(printer);
     }
 
-    printer->Print(vars_, "$input_class$ req, "
-                   "final Callback<$output_class$> callback) {\n");
+    // With query_string, GET requests go in the path, and there is nothing
+    // for masks or diffs to apply to.
+    bool in_query = options_.query_string && options.http_method() == "GET";
+    if (in_query && options.diff()) {
+      error_->assign("diff method " + descriptor_->full_name() +
+                     " can't be GET with query_string=true");
+      return;
+    }
+    // With field masks, the method without a mask sends every field.
+    bool masked = options_.field_masks && !options.compact() &&
+                  !options.diff() && !in_query;
+    if (masked) {
+      GenerateSignature(printer, method_args, NULL);
+      printer->Print(vars_, "  $method_name$(");
+      for (int i = 0; i < method_args.size(); i++) {
+        printer->Print("$v$, ", "v", method_args[i]);
+      }
+      printer->Print("req, null, callback);\n"
+                     "}\n\n");
+    }
+    if (options.diff()) {
+      // previous is what the server has; without it, send everything.
+      GenerateSignature(printer, method_args, "$input_class$ previous");
+      vars_["params"] =
+          "previous == null ? req.toJSON() : req.toJSONDiff(previous)";
+    } else if (masked) {
+      GenerateSignature(printer, method_args, "$input_class$.JSONMask mask");
+      vars_["params"] = "req.toJSON(mask)";
+    } else {
+      GenerateSignature(printer, method_args, NULL);
+      vars_["params"] = "req.to" + vars_["dialect"] + "JSON()";
+    }
     printer->Indent();
 
     const char* sep = "";
@@ -520,24 +2073,233 @@ class MethodGenerator {
       printer->Print(";\n");
     }
 
-    printer->Print(
-        vars_,
-        "org.json.JSONObject params = null;\n"
-        "try {\n"
-        "  params = req.toJSON();\n"
-        "} catch (org.json.JSONException e) {\n"
-        "  callback.done(-1, \"JSON error: \" + e, null);\n"
-        "  return;\n"
-        "}\n"
-        "this.doCall(path, \"$http_method$\", params, $output_class$.class, callback);\n"
-        "");
+    // Unary calls are timed if there is a CallListener.
+    if (!descriptor_->server_streaming()) {
+      printer->Print(
+          "final CallListener listener = this.callListener;\n"
+          "final long start = listener == null ? 0 : System.nanoTime();\n");
+    }
+    if (in_query) {
+      printer->Print(vars_,
+          "$request_type$ params = null;\n"
+          "StringBuilder query = new StringBuilder(path).append('?');\n"
+          "try {\n"
+          "  req.writeQueryString(query);\n"
+          "} catch (org.json.JSONException e) {\n"
+          "  callback.done(-1, \"JSON error: \" + e$no_response$);\n"
+          "  return;\n"
+          "}\n"
+          "if (query.length() > path.length() + 1) {\n"
+          "  path = query.toString();\n"
+          "}\n");
+    } else {
+      GenerateParams(printer, masked);
+    }
+    if (descriptor_->server_streaming()) {
+      printer->Print(vars_,
+          "this.doStreamCall(path, \"$http_method$\", params, new StreamHandler() {\n"
+          "  public boolean element(String json) throws org.json.JSONException {\n"
+          "    return callback.next(\n"
+          "        $output_class$.parseFromJSON(new org.json.JSONObject(json)));\n"
+          "  }\n"
+          "\n"
+          "  public void done(int code, String error) {\n"
+          "    callback.done(code, error);\n"
+          "  }\n"
+          "});\n");
+    } else {
+      map<string, string> vars = vars_;
+      printer->Print(vars,
+          "final MeasuredCallback<$output_class$> measured = listener == null\n"
+          "    ? null : new MeasuredCallback<$output_class$>(\n"
+          "        listener, \"$method_name$\", start, callback);\n"
+          "final Callback<$output_class$> reply =\n"
+          "    measured == null ? callback : measured;\n");
+      if (options_.bytes_transport) {
+        // The transport only sees the decoder, so it is the decoder that
+        // measures the response.
+        printer->Print(vars,
+            "ResponseDecoder<$output_class$> decoder = $response$;\n"
+            "if (measured != null) {\n"
+            "  measured.requestBytes = params == null ? 0 : params.length;\n"
+            "  decoder = measured.measure(decoder);\n"
+            "}\n");
+        vars["response"] = "decoder";
+      } else {
+        vars["stats_arg"] = "measured, ";
+      }
+      vars["reply"] = "reply";
+      if (options.cache_ttl_ms() > 0) {
+        vars["reply"] = "this.cacheResponse(cacheKey, " +
+            compiler::SimpleItoa(options.cache_ttl_ms()) + "L, reply)";
+        printer->Print(vars,
+            "final String cacheKey = \"$http_method$ \" + path + \" \" + $params_key$;\n"
+            "if (this.replayCachedResponse(cacheKey, reply)) {\n"
+            "  return;\n"
+            "}\n");
+      }
+      if (options.diff()) {
+        // Only a diff goes to doDiffCall, so the transport can mark it.
+        printer->Print("if (previous == null) {\n");
+        printer->Indent();
+        GenerateCall(printer, vars);
+        printer->Outdent();
+        printer->Print("} else {\n");
+        printer->Indent();
+        vars["call"] = "doDiffCall";
+        GenerateCall(printer, vars);
+        printer->Outdent();
+        printer->Print("}\n");
+      } else {
+        GenerateCall(printer, vars);
+      }
+    }
 
     printer->Outdent();
     printer->Print("}\n\n");
+
+    if (options.paginated()) {
+      GeneratePages(printer, method_args, options);
+    }
+  }
+
+  // Hands the call to the transport, or to the coalescing, hedging etc. in
+  // front of it.
+  void GenerateCall(io::Printer* printer, const map<string, string>& vars) {
+    printer->Print(vars,
+        "this.$call$(path, \"$http_method$\", params, $response$,\n"
+        "    $hedge$$stats_arg$$reply$);\n");
+  }
+
+  // Serializes req into params, for the transport.
+  void GenerateParams(io::Printer* printer, bool masked) {
+    printer->Print(vars_,
+        "$request_type$ params = null;\n"
+        "try {\n");
+    if (!options_.bytes_transport) {
+      printer->Print(vars_, "  params = $params$;\n");
+    } else if (vars_["params"] == "req.toJSON()") {
+      // Stream straight into the body, without a JSONObject.
+      printer->Print(
+          "  StringBuilder json = new StringBuilder();\n"
+          "  req.writeJSON(json);\n"
+          "  params = json.toString().getBytes(JSON_UTF8);\n");
+    } else if (masked) {
+      printer->Print(vars_,
+          "  if (mask == null) {\n"
+          "    StringBuilder json = new StringBuilder();\n"
+          "    req.writeJSON(json);\n"
+          "    params = json.toString().getBytes(JSON_UTF8);\n"
+          "  } else {\n"
+          "    params = ($params$).toString().getBytes(JSON_UTF8);\n"
+          "  }\n");
+    } else {
+      printer->Print(vars_,
+          "  params = ($params$).toString().getBytes(JSON_UTF8);\n");
+    }
+    printer->Print(vars_,
+        "} catch (org.json.JSONException e) {\n"
+        "  callback.done(-1, \"JSON error: \" + e$no_response$);\n"
+        "  return;\n"
+        "}\n");
+  }
+
+  // The ResponseDecoder of the method, for bytes_transport.
+  void GenerateDecoder(io::Printer* printer) {
+    printer->Print(vars_,
+        "private static final ResponseDecoder<$output_class$> $response$ =\n"
+        "    new ResponseDecoder<$output_class$>() {\n"
+        "      public $output_class$ decode(byte[] body)\n"
+        "          throws java.io.IOException, org.json.JSONException {\n");
+    if (options_.jackson && vars_["dialect"].empty()) {
+      printer->Print(vars_,
+          "        return $output_class$.parseFromJSON(JSON_FACTORY.createParser(body));\n");
+    } else {
+      printer->Print(vars_,
+          "        return $output_class$.parseFrom$dialect$JSON(\n"
+          "            new org.json.JSONObject(new String(body, JSON_UTF8)));\n");
+    }
+    printer->Print(
+        "      }\n"
+        "    };\n"
+        "\n");
+  }
+
+  // Whether the method has the "Pages" variant, see GeneratePages.
+  static bool IsPaginated(const MethodDescriptor* d) {
+    return d->options().GetExtension(dx_method_options).paginated();
   }
 
  private:
+  // $method_name$Pages, which returns a Pager over the responses of the
+  // method, one per page, chained by their page tokens.
+  void GeneratePages(io::Printer* printer, const vector<string>& method_args,
+                     const DXMethodOptions& options) {
+    const FieldDescriptor* token =
+        descriptor_->input_type()->FindFieldByName(options.page_token_field());
+    const FieldDescriptor* next = descriptor_->output_type()->FindFieldByName(
+        options.next_page_token_field());
+    if (token == NULL || token->type() != FieldDescriptor::TYPE_STRING ||
+        token->is_repeated() || next == NULL ||
+        next->type() != FieldDescriptor::TYPE_STRING || next->is_repeated() ||
+        options.diff() || descriptor_->server_streaming()) {
+      error_->assign("paginated method " + descriptor_->full_name() +
+                     " needs string fields " + options.page_token_field() +
+                     " in its request and " + options.next_page_token_field() +
+                     " in its response, and can't be diff or streaming");
+      return;
+    }
+    map<string, string> vars = vars_;
+    vars["token_field"] = java::UnderscoresToCapitalizedCamelCase(token);
+    vars["next_field"] = java::UnderscoresToCapitalizedCamelCase(next);
+
+    printer->Print(vars, "public Pager<$output_class$> $method_name$Pages(");
+    for (int i = 0; i < method_args.size(); i++) {
+      printer->Print("final String $v$, ", "v", method_args[i]);
+    }
+    printer->Print(vars,
+        "final $input_class$ req,\n"
+        "    int prefetch) {\n"
+        "  return new Pager<$output_class$>(prefetch) {\n"
+        "    protected void fetch(String token, Callback<$output_class$> callback) {\n"
+        "      $method_name$(");
+    for (int i = 0; i < method_args.size(); i++) {
+      printer->Print("$v$, ", "v", method_args[i]);
+    }
+    printer->Print(vars,
+        "token == null ? req\n"
+        "          : req.toBuilder().set$token_field$(token).build(), callback);\n"
+        "    }\n"
+        "\n"
+        "    protected String nextToken($output_class$ page) {\n"
+        "      return page.get$next_field$();\n"
+        "    }\n"
+        "  }.start();\n"
+        "}\n"
+        "\n");
+  }
+
+  // Prints the method up to its opening brace. If extra isn't NULL, it is
+  // one more parameter after req.
+  void GenerateSignature(io::Printer* printer,
+                         const vector<string>& method_args, const char* extra) {
+    printer->Print(vars_, "public void $method_name$(");
+    for (int i = 0; i < method_args.size(); i++) {
+      printer->Print("String $v$, ", "v", method_args[i]);
+    }
+    if (extra != NULL) {
+      printer->Print(vars_, "$input_class$ req, ");
+      printer->Print(vars_, extra);
+      printer->Print(vars_, ",\n"
+                     "    final $callback_type$ callback) {\n");
+    } else {
+      printer->Print(vars_, "$input_class$ req, "
+                     "final $callback_type$ callback) {\n");
+    }
+  }
+
   const MethodDescriptor* descriptor_;
+  const GeneratorOptions& options_;
   string* error_;
   map<string, string> vars_;
 };
@@ -546,8 +2308,10 @@ class MethodGenerator {
 // Generate code for a service.
 class ServiceGenerator {
  public:
-  ServiceGenerator(const ServiceDescriptor* descriptor, string* error)
-      : descriptor_(descriptor), error_(error) {
+  ServiceGenerator(const ServiceDescriptor* descriptor,
+                   const GeneratorOptions& options, string* error)
+      : descriptor_(descriptor), options_(options), error_(error) {
+    SetTransportVars(options_, &vars_);
   }
 
   void GenerateSource(io::Printer* printer) {
@@ -558,77 +2322,1375 @@ class ServiceGenerator {
         "public static interface Callback<T> {\n"
         "    void done(int code, String error, T response);\n"
         "}\n"
-        "\n"
+        "\n");
+    if (options_.bytes_transport) {
+      GenerateBytesTransport(printer);
+    }
+    printer->Print(vars_,
         "protected abstract <T> void doCall(\n"
         "    final String path,\n"
         "    final String httpMethod,\n"
-        "    final org.json.JSONObject params,\n"
-        "    final Class<T> responseType,\n"
+        "    final $request_type$ params,\n"
+        "    final $response_type$ $response_arg$,\n"
         "    final Callback<T> callback);\n\n");
+    if (HasUnaryMethods() && !options_.bytes_transport) {
+      GenerateStatsCall(printer, "Call");
+    }
+    if (HasCompactMethods()) {
+      printer->Print(vars_, options_.bytes_transport
+          ? "// Like doCall, but params are in the compact dialect. Send\n"
+            "// JSON_DIALECT_HEADER: JSON_DIALECT_COMPACT with the request.\n"
+          : "// Like doCall, but params are in the compact dialect, and the\n"
+            "// response must be parsed with parseFromCompactJSON. Send\n"
+            "// JSON_DIALECT_HEADER: JSON_DIALECT_COMPACT with the request.\n");
+      printer->Print(vars_,
+          "protected abstract <T> void doCompactCall(\n"
+          "    final String path,\n"
+          "    final String httpMethod,\n"
+          "    final $request_type$ params,\n"
+          "    final $response_type$ $response_arg$,\n"
+          "    final Callback<T> callback);\n"
+          "\n"
+          "public static final String JSON_DIALECT_HEADER = \"X-JSON-Dialect\";\n"
+          "public static final String JSON_DIALECT_COMPACT = \"compact\";\n"
+          "\n");
+      if (!options_.bytes_transport) {
+        GenerateStatsCall(printer, "CompactCall");
+      }
+    }
+    if (HasDiffMethods()) {
+      printer->Print(vars_,
+          "// Like doCall, but params is a diff made by toJSONDiff against the\n"
+          "// request the server already has, to apply with applyJSONDiff.\n"
+          "// Send JSON_DIFF_HEADER: JSON_DIFF_APPLY with the request.\n"
+          "protected abstract <T> void doDiffCall(\n"
+          "    final String path,\n"
+          "    final String httpMethod,\n"
+          "    final $request_type$ params,\n"
+          "    final $response_type$ $response_arg$,\n"
+          "    final Callback<T> callback);\n"
+          "\n"
+          "public static final String JSON_DIFF_HEADER = \"X-JSON-Diff\";\n"
+          "public static final String JSON_DIFF_APPLY = \"apply\";\n"
+          "\n");
+      if (!options_.bytes_transport) {
+        GenerateStatsCall(printer, "DiffCall");
+      }
+    }
+    if (HasStreamingMethods()) {
+      GenerateStreamSupport(printer);
+    }
+    if (HasUnaryMethods()) {
+      GenerateMetrics(printer);
+    }
+    if (HasCoalescedMethods()) {
+      GenerateCoalescing(printer);
+    }
+    if (HasCachedMethods()) {
+      GenerateResponseCache(printer);
+    }
+    if (HasHedgedMethods()) {
+      GenerateHedging(printer);
+    }
+    for (int i = 0; i < descriptor_->method_count(); i++) {
+      if (MethodGenerator::IsPaginated(descriptor_->method(i))) {
+        GeneratePager(printer);
+        break;
+      }
+    }
     for (int i = 0; i < descriptor_->method_count(); i++) {
-      MethodGenerator(descriptor_->method(i), error_).GenerateSource(printer);
+      MethodGenerator(descriptor_->method(i), options_, error_)
+          .GenerateSource(printer);
     }
     printer->Outdent();
     printer->Print("}\n\n");
   }
 
  private:
+  // The iterator returned by the Pages variant of paginated methods. Up to
+  // prefetch pages are fetched ahead of the caller, one request at a time
+  // since each needs the token from the page before. next() blocks until its
+  // page is there, and throws PageException if fetching it failed.
+  void GeneratePager(io::Printer* printer) {
+    printer->Print(
+        "public static class PageException extends RuntimeException {\n"
+        "  public final int code;\n"
+        "\n"
+        "  public PageException(int code, String error) {\n"
+        "    super(error);\n"
+        "    this.code = code;\n"
+        "  }\n"
+        "}\n"
+        "\n"
+        "public static abstract class Pager<T> implements java.util.Iterator<T> {\n"
+        "  private final java.util.ArrayDeque<T> ready = new java.util.ArrayDeque<T>();\n"
+        "  private final int prefetch;\n"
+        "  private String token = null;\n"
+        "  private boolean fetching = false;\n"
+        "  private boolean last = false;\n"
+        "  private PageException failure = null;\n"
+        "\n"
+        "  protected Pager(int prefetch) {\n"
+        "    this.prefetch = Math.max(1, prefetch);\n"
+        "  }\n"
+        "\n"
+        "  // Fetches the page for token, which is null for the first page.\n"
+        "  protected abstract void fetch(String token, Callback<T> callback);\n"
+        "\n"
+        "  // The token of the page after page; empty if page is the last.\n"
+        "  protected abstract String nextToken(T page);\n"
+        "\n"
+        "  Pager<T> start() {\n"
+        "    fetchMore();\n"
+        "    return this;\n"
+        "  }\n"
+        "\n"
+        "  private void fetchMore() {\n"
+        "    String t;\n"
+        "    synchronized (this) {\n"
+        "      if (fetching || last || ready.size() >= prefetch) {\n"
+        "        return;\n"
+        "      }\n"
+        "      fetching = true;\n"
+        "      t = token;\n"
+        "    }\n"
+        "    fetch(t, new Callback<T>() {\n"
+        "      public void done(int code, String error, T response) {\n"
+        "        onPage(code, error, response);\n"
+        "      }\n"
+        "    });\n"
+        "  }\n"
+        "\n"
+        "  private void onPage(int code, String error, T page) {\n"
+        "    synchronized (this) {\n"
+        "      fetching = false;\n"
+        "      if (page == null) {\n"
+        "        failure = new PageException(code, error);\n"
+        "        last = true;\n"
+        "      } else {\n"
+        "        ready.add(page);\n"
+        "        token = nextToken(page);\n"
+        "        last = token == null || token.isEmpty();\n"
+        "      }\n"
+        "      notifyAll();\n"
+        "    }\n"
+        "    fetchMore();\n"
+        "  }\n"
+        "\n"
+        "  public boolean hasNext() {\n"
+        "    fetchMore();\n"
+        "    synchronized (this) {\n"
+        "      while (ready.isEmpty() && failure == null && fetching) {\n"
+        "        try {\n"
+        "          wait();\n"
+        "        } catch (InterruptedException e) {\n"
+        "          Thread.currentThread().interrupt();\n"
+        "          throw new PageException(-1, \"interrupted\");\n"
+        "        }\n"
+        "      }\n"
+        "      return !ready.isEmpty() || failure != null;\n"
+        "    }\n"
+        "  }\n"
+        "\n"
+        "  public T next() {\n"
+        "    if (!hasNext()) {\n"
+        "      throw new java.util.NoSuchElementException();\n"
+        "    }\n"
+        "    T page;\n"
+        "    synchronized (this) {\n"
+        "      if (ready.isEmpty()) {\n"
+        "        throw failure;\n"
+        "      }\n"
+        "      page = ready.poll();\n"
+        "    }\n"
+        "    fetchMore();\n"
+        "    return page;\n"
+        "  }\n"
+        "\n"
+        "  public void remove() {\n"
+        "    throw new UnsupportedOperationException();\n"
+        "  }\n"
+        "}\n"
+        "\n");
+  }
+
+  // With bytes_transport, doCall gets the request as UTF-8 json, and a
+  // decoder generated for the response type of the method, so neither the
+  // transport nor the stub builds a JSONObject for the request, and the
+  // response is parsed without reflection.
+  void GenerateBytesTransport(io::Printer* printer) {
+    printer->Print(
+        "public static interface ResponseDecoder<T> {\n"
+        "    T decode(byte[] body) throws java.io.IOException, org.json.JSONException;\n"
+        "}\n"
+        "\n"
+        "protected static final java.nio.charset.Charset JSON_UTF8 =\n"
+        "    java.nio.charset.Charset.forName(\"UTF-8\");\n"
+        "\n");
+    if (options_.jackson) {
+      printer->Print(
+          "private static final com.fasterxml.jackson.core.JsonFactory JSON_FACTORY =\n"
+          "    new com.fasterxml.jackson.core.JsonFactory();\n"
+          "\n");
+    }
+    printer->Print(
+        "// Sends params, the request json in UTF-8, and passes the body of\n"
+        "// the response to decoder.decode.\n");
+  }
+
+  // The do$call$ that unary methods call when there is a CallListener.
+  // Transports can override it to fill in the parts of stats that only they
+  // know; by default it just calls do$call$.
+  void GenerateStatsCall(io::Printer* printer, const string& call) {
+    map<string, string> vars = vars_;
+    vars["call"] = call;
+    printer->Print(vars,
+        "// Like do$call$, but the transport can fill in parseNanos,\n"
+        "// requestBytes and responseBytes of stats, if it isn't null.\n"
+        "protected <T> void do$call$(\n"
+        "    final String path,\n"
+        "    final String httpMethod,\n"
+        "    final $request_type$ params,\n"
+        "    final $response_type$ $response_arg$,\n"
+        "    final CallStats stats,\n"
+        "    final Callback<T> callback) {\n"
+        "  do$call$(path, httpMethod, params, $response_arg$, callback);\n"
+        "}\n"
+        "\n");
+  }
+
+  bool HasUnaryMethods() {
+    for (int i = 0; i < descriptor_->method_count(); i++) {
+      if (!descriptor_->method(i)->server_streaming()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // The CallListener hook of unary methods, and CallHistogram, a listener
+  // that keeps latency histograms. Without a listener, a call only pays for
+  // reading the callListener field.
+  void GenerateMetrics(io::Printer* printer) {
+    printer->Print(
+        "public static interface CallListener {\n"
+        "    void onCall(CallStats stats);\n"
+        "}\n"
+        "\n"
+        "// The costs of one call. Only serializeNanos and transportNanos are\n"
+        "// always known; transports can fill in the rest in the doCall that\n"
+        "// takes a CallStats. With bytes_transport, the stub and the decoder\n"
+        "// fill them in.\n"
+        "public static class CallStats {\n"
+        "  public final String method;\n"
+        "  public int code;\n"
+        "  public long serializeNanos;\n"
+        "  // From handing the call to the transport to its callback, less\n"
+        "  // parseNanos.\n"
+        "  public long transportNanos;\n"
+        "  public long parseNanos;\n"
+        "  public int requestBytes = -1;\n"
+        "  public int responseBytes = -1;\n"
+        "\n"
+        "  CallStats(String method) {\n"
+        "    this.method = method;\n"
+        "  }\n"
+        "}\n"
+        "\n"
+        "private static final class MeasuredCallback<T> extends CallStats\n"
+        "    implements Callback<T> {\n"
+        "  private final CallListener listener;\n"
+        "  private final Callback<T> callback;\n"
+        "  private final long sent;\n"
+        "\n"
+        "  MeasuredCallback(CallListener listener, String method, long start,\n"
+        "      Callback<T> callback) {\n"
+        "    super(method);\n"
+        "    this.listener = listener;\n"
+        "    this.callback = callback;\n"
+        "    sent = System.nanoTime();\n"
+        "    serializeNanos = sent - start;\n"
+        "  }\n"
+        "\n"
+        "  public void done(int code, String error, T response) {\n"
+        "    this.code = code;\n"
+        "    transportNanos = System.nanoTime() - sent - parseNanos;\n"
+        "    callback.done(code, error, response);\n"
+        "    listener.onCall(this);\n"
+        "  }\n");
+    if (options_.bytes_transport) {
+      printer->Print(
+          "\n"
+          "  // decoder, also timing the parse and counting the response bytes.\n"
+          "  ResponseDecoder<T> measure(final ResponseDecoder<T> decoder) {\n"
+          "    return new ResponseDecoder<T>() {\n"
+          "      public T decode(byte[] body)\n"
+          "          throws java.io.IOException, org.json.JSONException {\n"
+          "        long begin = System.nanoTime();\n"
+          "        responseBytes = body.length;\n"
+          "        try {\n"
+          "          return decoder.decode(body);\n"
+          "        } finally {\n"
+          "          parseNanos = System.nanoTime() - begin;\n"
+          "        }\n"
+          "      }\n"
+          "    };\n"
+          "  }\n");
+    }
+    printer->Print(
+        "}\n"
+        "\n"
+        "private volatile CallListener callListener;\n"
+        "\n"
+        "// Gets the stats of every call from now on; null turns this off.\n"
+        "public void setCallListener(CallListener listener) {\n"
+        "  callListener = listener;\n"
+        "}\n"
+        "\n"
+        "// Counts calls per method by total time, in power of two buckets:\n"
+        "// bucket i has the calls that took less than 2^i microseconds, and at\n"
+        "// least 2^(i-1).\n"
+        "public static class CallHistogram implements CallListener {\n"
+        "  private final java.util.concurrent.ConcurrentHashMap<String,\n"
+        "      java.util.concurrent.atomic.AtomicLongArray> counts =\n"
+        "      new java.util.concurrent.ConcurrentHashMap<String,\n"
+        "          java.util.concurrent.atomic.AtomicLongArray>();\n"
+        "\n"
+        "  public void onCall(CallStats stats) {\n"
+        "    java.util.concurrent.atomic.AtomicLongArray c = counts.get(stats.method);\n"
+        "    if (c == null) {\n"
+        "      c = new java.util.concurrent.atomic.AtomicLongArray(64);\n"
+        "      java.util.concurrent.atomic.AtomicLongArray old =\n"
+        "          counts.putIfAbsent(stats.method, c);\n"
+        "      if (old != null) {\n"
+        "        c = old;\n"
+        "      }\n"
+        "    }\n"
+        "    long micros = (stats.serializeNanos + stats.transportNanos +\n"
+        "                   stats.parseNanos) / 1000;\n"
+        "    c.incrementAndGet(64 - Long.numberOfLeadingZeros(micros));\n"
+        "  }\n"
+        "\n"
+        "  // The number of calls to method in each bucket.\n"
+        "  public long[] buckets(String method) {\n"
+        "    long[] result = new long[64];\n"
+        "    java.util.concurrent.atomic.AtomicLongArray c = counts.get(method);\n"
+        "    for (int i = 0; c != null && i < result.length; i++) {\n"
+        "      result[i] = c.get(i);\n"
+        "    }\n"
+        "    return result;\n"
+        "  }\n"
+        "\n"
+        "  // An upper bound, in microseconds, of the time that fraction q of the\n"
+        "  // calls to method took; 0 if there weren't any.\n"
+        "  public long percentile(String method, double q) {\n"
+        "    long[] b = buckets(method);\n"
+        "    long total = 0;\n"
+        "    for (int i = 0; i < b.length; i++) {\n"
+        "      total += b[i];\n"
+        "    }\n"
+        "    long seen = 0;\n"
+        "    for (int i = 0; i < b.length; i++) {\n"
+        "      seen += b[i];\n"
+        "      if (seen > 0 && seen >= q * total) {\n"
+        "        return i < 63 ? 1L << i : Long.MAX_VALUE;\n"
+        "      }\n"
+        "    }\n"
+        "    return 0;\n"
+        "  }\n"
+        "}\n"
+        "\n");
+  }
+
+  bool HasCoalescedMethods() {
+    for (int i = 0; i < descriptor_->method_count(); i++) {
+      if (descriptor_->method(i)->options()
+              .GetExtension(dx_method_options).coalesce()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // coalescedCall, which coalesced methods call instead of doCall: while a
+  // call is in flight, identical calls (same http method, path and params)
+  // only add their callback to it, and all of them get its response.
+  void GenerateCoalescing(io::Printer* printer) {
+    printer->Print(vars_,
+        "private final java.util.HashMap<String, java.util.ArrayList<Callback<?>>> "
+        "inFlight =\n"
+        "    new java.util.HashMap<String, java.util.ArrayList<Callback<?>>>();\n"
+        "\n"
+        "private <T> void coalescedCall(\n"
+        "    final String path,\n"
+        "    final String httpMethod,\n"
+        "    final $request_type$ params,\n"
+        "    final $response_type$ $response_arg$,\n"
+        "$stats_param$"
+        "    final Callback<T> callback) {\n"
+        "  final String key = httpMethod + \" \" + path + \" \" + $params_key$;\n"
+        "  final java.util.ArrayList<Callback<?>> mine =\n"
+        "      new java.util.ArrayList<Callback<?>>();\n"
+        "  mine.add(callback);\n"
+        "  synchronized (inFlight) {\n"
+        "    java.util.ArrayList<Callback<?>> waiting = inFlight.get(key);\n"
+        "    if (waiting != null) {\n"
+        "      waiting.add(callback);\n"
+        "      return;\n"
+        "    }\n"
+        "    inFlight.put(key, mine);\n"
+        "  }\n"
+        "  Callback<T> all = new Callback<T>() {\n"
+        "    @SuppressWarnings(\"unchecked\")\n"
+        "    public void done(int code, String error, T response) {\n"
+        "      synchronized (inFlight) {\n"
+        "        if (inFlight.get(key) != mine) {\n"
+        "          return;\n"
+        "        }\n"
+        "        inFlight.remove(key);\n"
+        "      }\n"
+        "      for (int i = 0; i < mine.size(); i++) {\n"
+        "        ((Callback<T>) mine.get(i)).done(code, error, response);\n"
+        "      }\n"
+        "    }\n"
+        "  };\n"
+        "  // Otherwise the key would stay in flight, and identical calls would\n"
+        "  // wait forever.\n"
+        "  try {\n"
+        "    doCall(path, httpMethod, params, $response_arg$, $stats_arg$all);\n"
+        "  } catch (RuntimeException e) {\n"
+        "    all.done(-1, \"call failed: \" + e, null);\n"
+        "  }\n"
+        "}\n"
+        "\n");
+  }
+
+  bool HasCachedMethods() {
+    for (int i = 0; i < descriptor_->method_count(); i++) {
+      if (descriptor_->method(i)->options()
+              .GetExtension(dx_method_options).cache_ttl_ms() > 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // The LRU cache of the successful responses of methods with a
+  // cache_ttl_ms, keyed like coalescedCall. Responses are immutable, so hits
+  // are handed out as they are, without any parsing.
+  void GenerateResponseCache(io::Printer* printer) {
+    printer->Print(
+        "private static final class CachedResponse {\n"
+        "  final int code;\n"
+        "  final Object response;\n"
+        "  final long expires;\n"
+        "\n"
+        "  CachedResponse(int code, Object response, long expires) {\n"
+        "    this.code = code;\n"
+        "    this.response = response;\n"
+        "    this.expires = expires;\n"
+        "  }\n"
+        "}\n"
+        "\n"
+        "private final java.util.LinkedHashMap<String, CachedResponse> responseCache =\n"
+        "    new java.util.LinkedHashMap<String, CachedResponse>(16, 0.75f, true) {\n"
+        "      @Override\n"
+        "      protected boolean removeEldestEntry(\n"
+        "          java.util.Map.Entry<String, CachedResponse> eldest) {\n"
+        "        return size() > maxCachedResponses();\n"
+        "      }\n"
+        "    };\n"
+        "private final java.util.concurrent.atomic.AtomicLong cacheHits =\n"
+        "    new java.util.concurrent.atomic.AtomicLong();\n"
+        "private final java.util.concurrent.atomic.AtomicLong cacheMisses =\n"
+        "    new java.util.concurrent.atomic.AtomicLong();\n"
+        "\n"
+        "// The most responses kept in the cache.\n"
+        "protected int maxCachedResponses() {\n"
+        "  return 256;\n"
+        "}\n"
+        "\n"
+        "public long getCacheHits() {\n"
+        "  return cacheHits.get();\n"
+        "}\n"
+        "\n"
+        "public long getCacheMisses() {\n"
+        "  return cacheMisses.get();\n"
+        "}\n"
+        "\n"
+        "public void clearResponseCache() {\n"
+        "  synchronized (responseCache) {\n"
+        "    responseCache.clear();\n"
+        "  }\n"
+        "}\n"
+        "\n"
+        "@SuppressWarnings(\"unchecked\")\n"
+        "private <T> boolean replayCachedResponse(String key, Callback<T> callback) {\n"
+        "  CachedResponse cached;\n"
+        "  synchronized (responseCache) {\n"
+        "    cached = responseCache.get(key);\n"
+        "    if (cached != null && cached.expires - System.nanoTime() <= 0) {\n"
+        "      responseCache.remove(key);\n"
+        "      cached = null;\n"
+        "    }\n"
+        "  }\n"
+        "  if (cached == null) {\n"
+        "    cacheMisses.incrementAndGet();\n"
+        "    return false;\n"
+        "  }\n"
+        "  cacheHits.incrementAndGet();\n"
+        "  callback.done(cached.code, null, (T) cached.response);\n"
+        "  return true;\n"
+        "}\n"
+        "\n"
+        "private <T> Callback<T> cacheResponse(final String key, final long ttlMs,\n"
+        "    final Callback<T> callback) {\n"
+        "  return new Callback<T>() {\n"
+        "    public void done(int code, String error, T response) {\n"
+        "      if (error == null && response != null) {\n"
+        "        CachedResponse cached = new CachedResponse(\n"
+        "            code, response, System.nanoTime() + ttlMs * 1000000L);\n"
+        "        synchronized (responseCache) {\n"
+        "          responseCache.put(key, cached);\n"
+        "        }\n"
+        "      }\n"
+        "      callback.done(code, error, response);\n"
+        "    }\n"
+        "  };\n"
+        "}\n"
+        "\n");
+  }
+
+  bool HasHedgedMethods() {
+    for (int i = 0; i < descriptor_->method_count(); i++) {
+      if (descriptor_->method(i)->options()
+              .GetExtension(dx_method_options).hedge_after_ms() > 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // hedgedCall, which hedged methods call instead of doCall: if the call
+  // hasn't completed after hedgeAfterMs, the same call is sent again. The
+  // first success goes to the callback, or the last error if both fail.
+  // Hedges are paid for from a token bucket: each call to a hedged method
+  // adds hedgeBudget() tokens, up to maxHedgeTokens(), and each hedge takes
+  // one. The cap keeps quiet periods from saving up for a burst of hedges
+  // just when the server is slow. Both calls report to the same CallStats,
+  // so its sizes and parse time are from the one that completed last.
+  void GenerateHedging(io::Printer* printer) {
+    printer->Print(vars_,
+        "private java.util.Timer hedgeTimer;\n"
+        "private double hedgeTokens;\n"
+        "private final java.util.concurrent.atomic.AtomicLong hedges =\n"
+        "    new java.util.concurrent.atomic.AtomicLong();\n"
+        "\n"
+        "// The hedge tokens added per call to a hedged method.\n"
+        "protected double hedgeBudget() {\n"
+        "  return 0.1;\n"
+        "}\n"
+        "\n"
+        "// The most hedge tokens saved up, i.e. the longest burst of hedges.\n"
+        "protected double maxHedgeTokens() {\n"
+        "  return 10;\n"
+        "}\n"
+        "\n"
+        "public long getHedges() {\n"
+        "  return hedges.get();\n"
+        "}\n"
+        "\n"
+        "private synchronized java.util.Timer hedgeTimer() {\n"
+        "  if (hedgeTimer == null) {\n"
+        "    hedgeTimer = new java.util.Timer(\"hedge\", true);\n"
+        "  }\n"
+        "  return hedgeTimer;\n"
+        "}\n"
+        "\n"
+        "private synchronized void addHedgeTokens() {\n"
+        "  hedgeTokens = Math.min(hedgeTokens + hedgeBudget(), maxHedgeTokens());\n"
+        "}\n"
+        "\n"
+        "private synchronized boolean takeHedgeToken() {\n"
+        "  if (hedgeTokens < 1) {\n"
+        "    return false;\n"
+        "  }\n"
+        "  hedgeTokens -= 1;\n"
+        "  return true;\n"
+        "}\n"
+        "\n"
+        "private <T> void hedgedCall(\n"
+        "    final String path,\n"
+        "    final String httpMethod,\n"
+        "    final $request_type$ params,\n"
+        "    final $response_type$ $response_arg$,\n"
+        "    long hedgeAfterMs,\n"
+        "$stats_param$"
+        "    final Callback<T> callback) {\n"
+        "  final java.util.concurrent.atomic.AtomicBoolean done =\n"
+        "      new java.util.concurrent.atomic.AtomicBoolean();\n"
+        "  // The calls sent that haven't completed yet.\n"
+        "  final java.util.concurrent.atomic.AtomicInteger running =\n"
+        "      new java.util.concurrent.atomic.AtomicInteger(1);\n"
+        "  final Callback<T> leg = new Callback<T>() {\n"
+        "    public void done(int code, String error, T response) {\n"
+        "      boolean last = running.decrementAndGet() == 0;\n"
+        "      if ((error == null || last) && done.compareAndSet(false, true)) {\n"
+        "        callback.done(code, error, response);\n"
+        "      }\n"
+        "    }\n"
+        "  };\n"
+        "  addHedgeTokens();\n"
+        "  final java.util.TimerTask hedge = new java.util.TimerTask() {\n"
+        "    public void run() {\n"
+        "      if (done.get() || !takeHedgeToken()) {\n"
+        "        return;\n"
+        "      }\n"
+        "      // From here on, a failure of the first call waits for the hedge;\n"
+        "      // if it failed just now, the hedge's response is dropped.\n"
+        "      running.incrementAndGet();\n"
+        "      hedges.incrementAndGet();\n"
+        "      // An exception would kill the timer, and with it all hedging.\n"
+        "      try {\n"
+        "        doCall(path, httpMethod, params, $response_arg$, $stats_arg$leg);\n"
+        "      } catch (RuntimeException e) {\n"
+        "        leg.done(-1, \"hedge failed: \" + e, null);\n"
+        "      }\n"
+        "    }\n"
+        "  };\n"
+        "  final Callback<T> first = new Callback<T>() {\n"
+        "    public void done(int code, String error, T response) {\n"
+        "      hedge.cancel();\n"
+        "      leg.done(code, error, response);\n"
+        "    }\n"
+        "  };\n"
+        "  hedgeTimer().schedule(hedge, hedgeAfterMs);\n"
+        "  try {\n"
+        "    doCall(path, httpMethod, params, $response_arg$, $stats_arg$first);\n"
+        "  } catch (RuntimeException e) {\n"
+        "    // The caller gets the exception; a hedge mustn't call back too.\n"
+        "    done.set(true);\n"
+        "    hedge.cancel();\n"
+        "    throw e;\n"
+        "  }\n"
+        "}\n"
+        "\n");
+  }
+
+  bool HasStreamingMethods() {
+    for (int i = 0; i < descriptor_->method_count(); i++) {
+      if (descriptor_->method(i)->server_streaming()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // The callback and transport hook of server streaming methods, whose
+  // responses are newline-delimited json, one element per line. The
+  // transport hands the response body to readJSONStream, which parses and
+  // delivers one line at a time on the calling thread: a slow callback slows
+  // down reading from the connection, and only one line is held in memory.
+  void GenerateStreamSupport(io::Printer* printer) {
+    printer->Print(vars_,
+        "public static interface StreamCallback<T> {\n"
+        "    // Called for each element; return false to cancel the stream.\n"
+        "    boolean next(T element);\n"
+        "    // Called once, when the stream ends, fails or is cancelled.\n"
+        "    void done(int code, String error);\n"
+        "}\n"
+        "\n"
+        "public static interface StreamHandler {\n"
+        "    boolean element(String json) throws org.json.JSONException;\n"
+        "    void done(int code, String error);\n"
+        "}\n"
+        "\n"
+        "// Like doCall, but the response is a stream of json lines. Pass its\n"
+        "// body to readJSONStream, or call handler.done on failure.\n"
+        "protected abstract void doStreamCall(\n"
+        "    final String path,\n"
+        "    final String httpMethod,\n"
+        "    final $request_type$ params,\n"
+        "    final StreamHandler handler);\n"
+        "\n"
+        "public static final int MAX_JSON_STREAM_LINE = 16 << 20;\n"
+        "\n"
+        "public static void readJSONStream(java.io.InputStream in,\n"
+        "    StreamHandler handler) {\n"
+        "  int code = 0;\n"
+        "  String error = null;\n"
+        "  try {\n"
+        "    readJSONLines(in, handler);\n"
+        "  } catch (java.io.IOException e) {\n"
+        "    code = -1;\n"
+        "    error = \"IO error: \" + e;\n"
+        "  } catch (org.json.JSONException e) {\n"
+        "    code = -1;\n"
+        "    error = \"JSON error: \" + e;\n"
+        "  } catch (RuntimeException e) {\n"
+        "    // From parsing an element, or the callback it went to.\n"
+        "    code = -1;\n"
+        "    error = \"stream failed: \" + e;\n"
+        "  } finally {\n"
+        "    try {\n"
+        "      in.close();\n"
+        "    } catch (java.io.IOException e) {\n"
+        "      // Nothing more to read anyway.\n"
+        "    }\n"
+        "  }\n"
+        "  handler.done(code, error);\n"
+        "}\n"
+        "\n"
+        "private static void readJSONLines(java.io.InputStream in,\n"
+        "    StreamHandler handler)\n"
+        "    throws java.io.IOException, org.json.JSONException {\n"
+        "  byte[] buf = new byte[8192];\n"
+        "  java.io.ByteArrayOutputStream line = new java.io.ByteArrayOutputStream();\n"
+        "  int n;\n"
+        "  while ((n = in.read(buf)) != -1) {\n"
+        "    int start = 0;\n"
+        "    for (int i = 0; i < n; i++) {\n"
+        "      if (buf[i] == '\\n') {\n"
+        "        line.write(buf, start, i - start);\n"
+        "        start = i + 1;\n"
+        "        if (!readJSONLine(line, handler)) {\n"
+        "          return;\n"
+        "        }\n"
+        "      }\n"
+        "    }\n"
+        "    line.write(buf, start, n - start);\n"
+        "    if (line.size() > MAX_JSON_STREAM_LINE) {\n"
+        "      throw new java.io.IOException(\"json line too long\");\n"
+        "    }\n"
+        "  }\n"
+        "  readJSONLine(line, handler);\n"
+        "}\n"
+        "\n"
+        "private static boolean readJSONLine(java.io.ByteArrayOutputStream line,\n"
+        "    StreamHandler handler)\n"
+        "    throws java.io.IOException, org.json.JSONException {\n"
+        "  String json = line.toString(\"UTF-8\").trim();\n"
+        "  line.reset();\n"
+        "  return json.isEmpty() || handler.element(json);\n"
+        "}\n"
+        "\n");
+  }
+
+  bool HasDiffMethods() {
+    for (int i = 0; i < descriptor_->method_count(); i++) {
+      if (descriptor_->method(i)->options()
+              .GetExtension(dx_method_options).diff()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool HasCompactMethods() {
+    for (int i = 0; i < descriptor_->method_count(); i++) {
+      if (descriptor_->method(i)->options()
+              .GetExtension(dx_method_options).compact()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
   const ServiceDescriptor* descriptor_;
+  const GeneratorOptions& options_;
   string* error_;
+  map<string, string> vars_;
 };
 
 
-class MyCodeGenerator : public CodeGenerator {
- public:
-  virtual ~MyCodeGenerator() {}
+// Static helpers used by the generated writeJSON methods of every message in
+// the file. They match the formatting of Android's org.json, so that writeJSON
+// produces the same bytes as toJSON().toString().
+static void GenerateJsonHelpers(io::Printer* printer) {
+  printer->Print(
+      "static void writeJSONKey(\n"
+      "    java.lang.StringBuilder out, int start, String key) {\n"
+      "  if (out.length() != start) {\n"
+      "    out.append(',');\n"
+      "  }\n"
+      "  out.append(key);\n"
+      "}\n"
+      "\n"
+      "static void writeJSONNumber(java.lang.StringBuilder out, double d)\n"
+      "    throws org.json.JSONException {\n"
+      "  if (Double.isNaN(d) || Double.isInfinite(d)) {\n"
+      "    throw new org.json.JSONException(\"Forbidden numeric value: \" + d);\n"
+      "  }\n"
+      "  if (d == 0 && Double.doubleToRawLongBits(d) != 0) {\n"
+      "    out.append(\"-0\");\n"
+      "    return;\n"
+      "  }\n"
+      "  long l = (long) d;\n"
+      "  if (d == (double) l) {\n"
+      "    out.append(l);\n"
+      "  } else {\n"
+      "    out.append(d);\n"
+      "  }\n"
+      "}\n"
+      "\n"
+      "private static final char[] JSON_HEX = \"0123456789abcdef\".toCharArray();\n"
+      "\n"
+      "static void writeJSONString(java.lang.StringBuilder out, String s) {\n"
+      "  out.append('\"');\n"
+      "  for (int i = 0, n = s.length(); i < n; i++) {\n"
+      "    char c = s.charAt(i);\n"
+      "    switch (c) {\n"
+      "      case '\"':\n"
+      "      case '\\\\':\n"
+      "      case '/':\n"
+      "        out.append('\\\\').append(c);\n"
+      "        break;\n"
+      "      case '\\t':\n"
+      "        out.append(\"\\\\t\");\n"
+      "        break;\n"
+      "      case '\\b':\n"
+      "        out.append(\"\\\\b\");\n"
+      "        break;\n"
+      "      case '\\n':\n"
+      "        out.append(\"\\\\n\");\n"
+      "        break;\n"
+      "      case '\\r':\n"
+      "        out.append(\"\\\\r\");\n"
+      "        break;\n"
+      "      case '\\f':\n"
+      "        out.append(\"\\\\f\");\n"
+      "        break;\n"
+      "      default:\n"
+      "        if (c <= 0x1F) {\n"
+      "          out.append(\"\\\\u00\")\n"
+      "              .append(JSON_HEX[c >> 4]).append(JSON_HEX[c & 0xF]);\n"
+      "        } else {\n"
+      "          out.append(c);\n"
+      "        }\n"
+      "        break;\n"
+      "    }\n"
+      "  }\n"
+      "  out.append('\"');\n"
+      "}\n"
+      "\n");
+}
 
-  static void doMessage(const Descriptor* d,
-                        const string& java_filename,
-                        GeneratorContext* context,
-                        string* error) {
-    {
-      scoped_ptr<io::ZeroCopyOutputStream> output(context->OpenForInsert(
-          java_filename, "class_scope:" + d->full_name()));
-      io::Printer printer(output.get(), '$');
-      MessageGenerator(d, error).GenerateSource(&printer);
+
+// Renders the class_scope code of one message into out.
+static void RenderMessage(const Descriptor* d,
+                          const GeneratorOptions& options,
+                          string* out,
+                          string* error) {
+  io::StringOutputStream output(out);
+  io::Printer printer(&output, '$');
+  MessageGenerator(d, options, error).GenerateSource(&printer);
+}
+
+// Work shared by the threads of RenderMessages.
+struct RenderJob {
+  const vector<const Descriptor*>* messages;
+  const GeneratorOptions* options;
+  vector<string>* bodies;
+  vector<string>* errors;
+  pthread_mutex_t mutex;
+  int next;
+};
+
+static void* RenderWorker(void* arg) {
+  RenderJob* job = static_cast<RenderJob*>(arg);
+  while (true) {
+    pthread_mutex_lock(&job->mutex);
+    int i = job->next++;
+    pthread_mutex_unlock(&job->mutex);
+    if (i >= job->messages->size()) {
+      return NULL;
     }
-    for (int j = 0; j < d->nested_type_count(); j++) {
-      doMessage(d->nested_type(j), java_filename, context, error);
+    RenderMessage((*job->messages)[i], *job->options,
+                  &(*job->bodies)[i], &(*job->errors)[i]);
+  }
+}
+
+// Renders the messages on options.threads threads, counting the calling
+// one; bodies[i] and errors[i] get the output for messages[i], so the result
+// doesn't depend on timing. If threads can't be started, the ones that did,
+// or just the calling thread, do all the work.
+static void RenderMessages(const vector<const Descriptor*>& messages,
+                           const GeneratorOptions& options,
+                           vector<string>* bodies,
+                           vector<string>* errors) {
+  bodies->resize(messages.size());
+  errors->resize(messages.size());
+  RenderJob job;
+  job.messages = &messages;
+  job.options = &options;
+  job.bodies = bodies;
+  job.errors = errors;
+  pthread_mutex_init(&job.mutex, NULL);
+  job.next = 0;
+
+  int threads = options.threads;
+  if (threads > messages.size()) {
+    threads = messages.size();
+  }
+  vector<pthread_t> workers;
+  for (int i = 1; i < threads; i++) {
+    pthread_t worker;
+    if (pthread_create(&worker, NULL, RenderWorker, &job) != 0) {
+      break;
     }
+    workers.push_back(worker);
+  }
+  RenderWorker(&job);
+  for (int i = 0; i < workers.size(); i++) {
+    pthread_join(workers[i], NULL);
+  }
+  pthread_mutex_destroy(&job.mutex);
+}
+
+static void doMessage(const Descriptor* d,
+                      const string& java_filename,
+                      const GeneratorOptions& options,
+                      GeneratorContext* context,
+                      string* error) {
+  scoped_ptr<io::ZeroCopyOutputStream> output(context->OpenForInsert(
+      java_filename, "class_scope:" + d->full_name()));
+  io::Printer printer(output.get(), '$');
+  MessageGenerator(d, options, error).GenerateSource(&printer);
+}
+
+// Part of the cache key; cached code from any other build of the plugin is
+// not used, since the generated code may have changed. The hash covers the
+// sources of the plugin and options.proto, see the Makefile.
+static const char kPluginVersion[] = "jsonjava " JSONJAVA_SOURCE_HASH;
+
+// Static helpers used by the generated Jackson parseFromJSON methods. Like
+// org.json, they accept numbers and booleans given as strings, but throw if
+// the string isn't one, rather than reading it as 0 or false.
+static void GenerateJacksonHelpers(io::Printer* printer) {
+  printer->Print(
+      "static double readJSONDouble(com.fasterxml.jackson.core.JsonParser parser)\n"
+      "    throws java.io.IOException {\n"
+      "  if (parser.getCurrentToken() !=\n"
+      "      com.fasterxml.jackson.core.JsonToken.VALUE_STRING) {\n"
+      "    return parser.getValueAsDouble();\n"
+      "  }\n"
+      "  try {\n"
+      "    return Double.parseDouble(parser.getText());\n"
+      "  } catch (NumberFormatException e) {\n"
+      "    throw new com.fasterxml.jackson.core.JsonParseException(\n"
+      "        parser, \"not a number: \" + parser.getText());\n"
+      "  }\n"
+      "}\n"
+      "\n"
+      "static long readJSONLong(com.fasterxml.jackson.core.JsonParser parser)\n"
+      "    throws java.io.IOException {\n"
+      "  if (parser.getCurrentToken() !=\n"
+      "      com.fasterxml.jackson.core.JsonToken.VALUE_STRING) {\n"
+      "    return parser.getValueAsLong();\n"
+      "  }\n"
+      "  try {\n"
+      "    return Long.parseLong(parser.getText());\n"
+      "  } catch (NumberFormatException e) {\n"
+      "    // Not an integer literal, e.g. \"1.0\" or \"1e3\".\n"
+      "    return (long) readJSONDouble(parser);\n"
+      "  }\n"
+      "}\n"
+      "\n"
+      "static int readJSONInt(com.fasterxml.jackson.core.JsonParser parser)\n"
+      "    throws java.io.IOException {\n"
+      "  if (parser.getCurrentToken() !=\n"
+      "      com.fasterxml.jackson.core.JsonToken.VALUE_STRING) {\n"
+      "    return parser.getValueAsInt();\n"
+      "  }\n"
+      "  return (int) readJSONLong(parser);\n"
+      "}\n"
+      "\n"
+      "static boolean readJSONBoolean(com.fasterxml.jackson.core.JsonParser parser)\n"
+      "    throws java.io.IOException {\n"
+      "  if (parser.getCurrentToken() !=\n"
+      "      com.fasterxml.jackson.core.JsonToken.VALUE_STRING) {\n"
+      "    return parser.getValueAsBoolean();\n"
+      "  }\n"
+      "  String s = parser.getText();\n"
+      "  if (\"true\".equalsIgnoreCase(s)) {\n"
+      "    return true;\n"
+      "  }\n"
+      "  if (\"false\".equalsIgnoreCase(s)) {\n"
+      "    return false;\n"
+      "  }\n"
+      "  throw new com.fasterxml.jackson.core.JsonParseException(\n"
+      "      parser, \"not a boolean: \" + s);\n"
+      "}\n"
+      "\n");
+}
+
+// Static helpers used by the generated writeQueryString methods. Keys and
+// values are percent-encoded as UTF-8; only the unreserved characters of
+// RFC 3986 are left as they are.
+static void GenerateQueryHelpers(io::Printer* printer) {
+  printer->Print(
+      "static void writeQueryKey(\n"
+      "    java.lang.StringBuilder out, String prefix, String name) {\n"
+      "  if (out.length() > 0) {\n"
+      "    char last = out.charAt(out.length() - 1);\n"
+      "    if (last != '?' && last != '&') {\n"
+      "      out.append('&');\n"
+      "    }\n"
+      "  }\n"
+      "  writeQueryEscaped(out, prefix);\n"
+      "  writeQueryEscaped(out, name);\n"
+      "  out.append('=');\n"
+      "}\n"
+      "\n"
+      "private static final char[] QUERY_HEX = \"0123456789ABCDEF\".toCharArray();\n"
+      "private static final java.nio.charset.Charset QUERY_UTF8 =\n"
+      "    java.nio.charset.Charset.forName(\"UTF-8\");\n"
+      "\n"
+      "static void writeQueryEscaped(java.lang.StringBuilder out, String s) {\n"
+      "  for (int i = 0, n = s.length(); i < n; i++) {\n"
+      "    char c = s.charAt(i);\n"
+      "    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||\n"
+      "        (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.' ||\n"
+      "        c == '~') {\n"
+      "      out.append(c);\n"
+      "    } else if (c < 0x80) {\n"
+      "      out.append('%').append(QUERY_HEX[c >> 4]).append(QUERY_HEX[c & 0xF]);\n"
+      "    } else {\n"
+      "      int end = Character.isHighSurrogate(c) && i + 1 < n ? i + 2 : i + 1;\n"
+      "      byte[] bytes = s.substring(i, end).getBytes(QUERY_UTF8);\n"
+      "      for (int j = 0; j < bytes.length; j++) {\n"
+      "        int b = bytes[j] & 0xFF;\n"
+      "        out.append('%').append(QUERY_HEX[b >> 4]).append(QUERY_HEX[b & 0xF]);\n"
+      "      }\n"
+      "      i = end - 1;\n"
+      "    }\n"
+      "  }\n"
+      "}\n"
+      "\n");
+}
+
+// Base64 coding of dx_packed fields, only generated in files that have some.
+// The values are bulk copied through a little-endian ByteBuffer view.
+static void GeneratePackedHelpers(io::Printer* printer) {
+  printer->Print(
+      "private static final char[] JSON_BASE64 =\n"
+      "    \"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/\"\n"
+      "    .toCharArray();\n"
+      "private static final int[] JSON_BASE64_VALUES = new int[128];\n"
+      "static {\n"
+      "  java.util.Arrays.fill(JSON_BASE64_VALUES, -1);\n"
+      "  for (int i = 0; i < JSON_BASE64.length; i++) {\n"
+      "    JSON_BASE64_VALUES[JSON_BASE64[i]] = i;\n"
+      "  }\n"
+      "}\n"
+      "\n"
+      "static String encodeJSONPacked(java.nio.ByteBuffer buf) {\n"
+      "  byte[] b = buf.array();\n"
+      "  int n = buf.position();\n"
+      "  char[] out = new char[(n + 2) / 3 * 4];\n"
+      "  for (int i = 0, o = 0; i < n; i += 3) {\n"
+      "    int bits = (b[i] & 0xFF) << 16;\n"
+      "    if (i + 1 < n) {\n"
+      "      bits |= (b[i + 1] & 0xFF) << 8;\n"
+      "    }\n"
+      "    if (i + 2 < n) {\n"
+      "      bits |= b[i + 2] & 0xFF;\n"
+      "    }\n"
+      "    out[o++] = JSON_BASE64[bits >> 18];\n"
+      "    out[o++] = JSON_BASE64[(bits >> 12) & 63];\n"
+      "    out[o++] = i + 1 < n ? JSON_BASE64[(bits >> 6) & 63] : '=';\n"
+      "    out[o++] = i + 2 < n ? JSON_BASE64[bits & 63] : '=';\n"
+      "  }\n"
+      "  return new String(out);\n"
+      "}\n"
+      "\n"
+      "static java.nio.ByteBuffer decodeJSONPacked(String s, int size)\n"
+      "    throws org.json.JSONException {\n"
+      "  int len = s.length();\n"
+      "  while (len > 0 && s.charAt(len - 1) == '=') {\n"
+      "    len--;\n"
+      "  }\n"
+      "  byte[] b = new byte[len * 3 / 4];\n"
+      "  int bits = 0;\n"
+      "  int pending = 0;\n"
+      "  int o = 0;\n"
+      "  for (int i = 0; i < len; i++) {\n"
+      "    char c = s.charAt(i);\n"
+      "    int v = c < 128 ? JSON_BASE64_VALUES[c] : -1;\n"
+      "    if (v < 0) {\n"
+      "      throw new org.json.JSONException(\"bad base64 in packed field\");\n"
+      "    }\n"
+      "    bits = ((bits << 6) | v) & 0xFFFF;\n"
+      "    pending += 6;\n"
+      "    if (pending >= 8) {\n"
+      "      pending -= 8;\n"
+      "      b[o++] = (byte) (bits >> pending);\n"
+      "    }\n"
+      "  }\n"
+      "  if (o % size != 0) {\n"
+      "    throw new org.json.JSONException(\"bad length of packed field\");\n"
+      "  }\n"
+      "  return java.nio.ByteBuffer.wrap(b, 0, o)\n"
+      "      .order(java.nio.ByteOrder.LITTLE_ENDIAN);\n"
+      "}\n"
+      "\n");
+  static const char* const kTypes[][4] = {
+    // name, java type, boxed type, size
+    { "Double", "double", "Double", "8" },
+    { "Float", "float", "Float", "4" },
+    { "Long", "long", "Long", "8" },
+    { "Int", "int", "Integer", "4" },
+  };
+  for (int i = 0; i < sizeof(kTypes) / sizeof(kTypes[0]); i++) {
+    map<string, string> vars;
+    vars["name"] = kTypes[i][0];
+    vars["type"] = kTypes[i][1];
+    vars["boxed"] = kTypes[i][2];
+    vars["size"] = kTypes[i][3];
+    printer->Print(vars,
+        "static String encodeJSONPacked$name$s(java.util.List<$boxed$> values) {\n"
+        "  java.nio.ByteBuffer buf = java.nio.ByteBuffer.allocate(\n"
+        "      values.size() * $size$).order(java.nio.ByteOrder.LITTLE_ENDIAN);\n"
+        "  for (int i = 0; i < values.size(); i++) {\n"
+        "    buf.put$name$(values.get(i));\n"
+        "  }\n"
+        "  return encodeJSONPacked(buf);\n"
+        "}\n"
+        "\n"
+        "static $type$[] decodeJSONPacked$name$s(String s)\n"
+        "    throws org.json.JSONException {\n"
+        "  java.nio.$name$Buffer buf = decodeJSONPacked(s, $size$).as$name$Buffer();\n"
+        "  $type$[] values = new $type$[buf.remaining()];\n"
+        "  buf.get(values);\n"
+        "  return values;\n"
+        "}\n"
+        "\n");
   }
+}
 
-  virtual bool Generate(const FileDescriptor* file,
-                        const string& parameter,
-                        GeneratorContext* context,
-                        string* error) const {
-    string package_dir = java::JavaPackageToDir(java::FileJavaPackage(file));
-    string java_filename = package_dir;
-    java_filename += java::FileClassName(file);
-    java_filename += ".java";
+// Parsing of dx_parallel arrays: the array is split into chunks of
+// PARALLEL_JSON_CHUNK elements, all but the last of which are forked to a
+// pool of the outer class while the calling thread parses the last one. The
+// pool is created on first use; ForkJoinPool.commonPool() would need Java 8,
+// or Android API level 24.
+static void GenerateParallelHelpers(io::Printer* printer) {
+  printer->Print(
+      "public static interface JSONElementParser<T> {\n"
+      "  T parse(org.json.JSONObject json) throws org.json.JSONException;\n"
+      "}\n"
+      "\n"
+      "private static final int PARALLEL_JSON_CHUNK = 1024;\n"
+      "private static volatile int parallelJSONThreshold = 8192;\n"
+      "\n"
+      "// dx_parallel arrays with fewer elements than this are parsed on the\n"
+      "// calling thread.\n"
+      "public static int getParallelJSONThreshold() {\n"
+      "  return parallelJSONThreshold;\n"
+      "}\n"
+      "\n"
+      "public static void setParallelJSONThreshold(int threshold) {\n"
+      "  parallelJSONThreshold = threshold;\n"
+      "}\n"
+      "\n"
+      "private static java.util.concurrent.ForkJoinPool parallelJSONPool;\n"
+      "\n"
+      "private static synchronized java.util.concurrent.ForkJoinPool\n"
+      "    parallelJSONPool() {\n"
+      "  if (parallelJSONPool == null) {\n"
+      "    parallelJSONPool = new java.util.concurrent.ForkJoinPool();\n"
+      "  }\n"
+      "  return parallelJSONPool;\n"
+      "}\n"
+      "\n"
+      "@SuppressWarnings(\"unchecked\")\n"
+      "static <T> java.util.List<T> parseJSONParallel(\n"
+      "    final org.json.JSONArray arr, final JSONElementParser<T> parser)\n"
+      "    throws org.json.JSONException {\n"
+      "  final Object[] parsed = new Object[arr.length()];\n"
+      "  java.util.ArrayList<java.util.concurrent.ForkJoinTask<Void>> tasks =\n"
+      "      new java.util.ArrayList<java.util.concurrent.ForkJoinTask<Void>>();\n"
+      "  int last = (parsed.length - 1) / PARALLEL_JSON_CHUNK * PARALLEL_JSON_CHUNK;\n"
+      "  java.util.concurrent.ForkJoinPool pool = last > 0 ? parallelJSONPool() : null;\n"
+      "  for (int from = 0; from < last; from += PARALLEL_JSON_CHUNK) {\n"
+      "    final int start = from;\n"
+      "    tasks.add(pool.submit(\n"
+      "        new java.util.concurrent.Callable<Void>() {\n"
+      "          public Void call() throws org.json.JSONException {\n"
+      "            parseJSONChunk(arr, parser, parsed, start,\n"
+      "                start + PARALLEL_JSON_CHUNK);\n"
+      "            return null;\n"
+      "          }\n"
+      "        }));\n"
+      "  }\n"
+      "  org.json.JSONException error = null;\n"
+      "  try {\n"
+      "    parseJSONChunk(arr, parser, parsed, last, parsed.length);\n"
+      "  } catch (org.json.JSONException e) {\n"
+      "    error = e;\n"
+      "  }\n"
+      "  // Wait for every chunk, even after an error, so none of them is still\n"
+      "  // running when this returns.\n"
+      "  for (int i = 0; i < tasks.size(); i++) {\n"
+      "    try {\n"
+      "      tasks.get(i).get();\n"
+      "    } catch (java.util.concurrent.ExecutionException e) {\n"
+      "      Throwable cause = e.getCause();\n"
+      "      if (cause instanceof RuntimeException) {\n"
+      "        throw (RuntimeException) cause;\n"
+      "      }\n"
+      "      if (cause instanceof Error) {\n"
+      "        throw (Error) cause;\n"
+      "      }\n"
+      "      if (error == null) {\n"
+      "        error = (org.json.JSONException) cause;\n"
+      "      }\n"
+      "    } catch (InterruptedException e) {\n"
+      "      Thread.currentThread().interrupt();\n"
+      "      if (error == null) {\n"
+      "        error = new org.json.JSONException(\"interrupted\");\n"
+      "      }\n"
+      "    }\n"
+      "  }\n"
+      "  if (error != null) {\n"
+      "    throw error;\n"
+      "  }\n"
+      "  return (java.util.List<T>) java.util.Arrays.asList(parsed);\n"
+      "}\n"
+      "\n"
+      "private static <T> void parseJSONChunk(org.json.JSONArray arr,\n"
+      "    JSONElementParser<T> parser, Object[] parsed, int from, int to)\n"
+      "    throws org.json.JSONException {\n"
+      "  for (int i = from; i < to; i++) {\n"
+      "    parsed[i] = parser.parse(arr.getJSONObject(i));\n"
+      "  }\n"
+      "}\n"
+      "\n");
+}
 
-    // Insert methods to parse/generate JSON.
-    for (int i = 0; i < file->message_type_count(); i++) {
-      doMessage(file->message_type(i), java_filename, context, error);
+static bool HasParallelFields(const vector<const Descriptor*>& messages) {
+  string ignored;
+  for (int i = 0; i < messages.size(); i++) {
+    for (int j = 0; j < messages[i]->field_count(); j++) {
+      if (IsParallelField(messages[i]->field(j), &ignored)) {
+        return true;
+      }
     }
+  }
+  return false;
+}
 
-    // Insert service code.
-    {
+static bool HasPackedFields(const vector<const Descriptor*>& messages) {
+  string ignored;
+  for (int i = 0; i < messages.size(); i++) {
+    for (int j = 0; j < messages[i]->field_count(); j++) {
+      if (IsPackedField(messages[i]->field(j), &ignored)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static void GenerateFile(const FileDescriptor* file,
+                         const GeneratorOptions& options,
+                         GeneratorContext* context,
+                         string* error) {
+  string package_dir = java::JavaPackageToDir(java::FileJavaPackage(file));
+  string java_filename = package_dir;
+  java_filename += java::FileClassName(file);
+  java_filename += ".java";
+
+  // Insert methods to parse/generate JSON.
+  vector<const Descriptor*> messages;
+  CollectMessages(file, &messages);
+  if (options.threads > 1) {
+    // Render concurrently, then insert in the same order as below.
+    vector<string> bodies;
+    vector<string> errors;
+    RenderMessages(messages, options, &bodies, &errors);
+    for (int i = 0; i < messages.size(); i++) {
       scoped_ptr<io::ZeroCopyOutputStream> output(context->OpenForInsert(
-          java_filename, "outer_class_scope"));
+          java_filename, "class_scope:" + messages[i]->full_name()));
       io::Printer printer(output.get(), '$');
-      for (int i = 0; i < file->service_count(); i++) {
-        ServiceGenerator(file->service(i), error).GenerateSource(&printer);
+      printer.PrintRaw(bodies[i]);
+      if (!errors[i].empty()) {
+        error->assign(errors[i]);
       }
     }
+  } else {
+    for (int i = 0; i < messages.size(); i++) {
+      doMessage(messages[i], java_filename, options, context, error);
+    }
+  }
 
-    if (!error->empty()) {
-      fprintf(stderr, "ERROR: %s\n", error->c_str());
+  // Insert service code.
+  {
+    scoped_ptr<io::ZeroCopyOutputStream> output(context->OpenForInsert(
+        java_filename, "outer_class_scope"));
+    io::Printer printer(output.get(), '$');
+    GenerateJsonHelpers(&printer);
+    if (options.jackson) {
+      GenerateJacksonHelpers(&printer);
+    }
+    if (options.query_string) {
+      GenerateQueryHelpers(&printer);
+    }
+    if (HasPackedFields(messages)) {
+      GeneratePackedHelpers(&printer);
+    }
+    if (HasParallelFields(messages)) {
+      GenerateParallelHelpers(&printer);
+    }
+    for (int i = 0; i < file->service_count(); i++) {
+      ServiceGenerator(file->service(i), options, error).GenerateSource(&printer);
     }
-    return error->empty();
   }
-};
+}
+
+bool MyCodeGenerator::Generate(const FileDescriptor* file,
+                               const string& parameter,
+                               GeneratorContext* context,
+                               string* error) const {
+  GeneratorOptions options;
+  if (!options.Parse(parameter, error)) {
+    fprintf(stderr, "ERROR: %s\n", error->c_str());
+    return false;
+  }
+
+  // Let people know why their large messages get extra methods.
+  vector<const Descriptor*> messages;
+  CollectMessages(file, &messages);
+  string split;
+  for (int i = 0; i < messages.size(); i++) {
+    if (MessageGenerator::IsSplit(messages[i], options)) {
+      split += (split.empty() ? "" : ", ") + messages[i]->full_name();
+    }
+  }
+  if (!split.empty()) {
+    fprintf(stderr, "WARNING: %s: json methods of large messages were split "
+            "into helper methods, so that the JIT compiles them: %s\n",
+            file->name().c_str(), split.c_str());
+  }
+
+  if (options.cache_dir.empty()) {
+    GenerateFile(file, options, context, error);
+  } else {
+    string key = CodegenCacheKey(file, options.OutputKey(), kPluginVersion);
+    string path = CodegenCachePath(options.cache_dir, key);
+    vector<CachedOutput> outputs;
+    if (!LoadCachedOutputs(path, key, &outputs)) {
+      RecordingContext recording;
+      GenerateFile(file, options, &recording, error);
+      outputs = recording.outputs();
+      if (error->empty()) {
+        StoreCachedOutputs(path, key, outputs);
+      }
+    }
+    ReplayCachedOutputs(outputs, context);
+  }
 
-int main(int argc, char* argv[]) {
-  MyCodeGenerator generator;
-  return google::protobuf::compiler::PluginMain(argc, argv, &generator);
+  if (!error->empty()) {
+    fprintf(stderr, "ERROR: %s\n", error->c_str());
+  }
+  return error->empty();
 }
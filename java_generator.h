@@ -0,0 +1,22 @@
+// Author: Walt Lin
+// Protobuf compiler to Java services.
+
+#ifndef PROTOBUF_FOR_PB_JAVA_GENERATOR_H__
+#define PROTOBUF_FOR_PB_JAVA_GENERATOR_H__
+
+#include <string>
+#include <google/protobuf/compiler/code_generator.h>
+
+// Inserts json parsing/serialization methods into the classes generated by
+// --java_out, and generates a client class for each service.
+class MyCodeGenerator : public google::protobuf::compiler::CodeGenerator {
+ public:
+  virtual ~MyCodeGenerator() {}
+
+  virtual bool Generate(const google::protobuf::FileDescriptor* file,
+                        const std::string& parameter,
+                        google::protobuf::compiler::GeneratorContext* context,
+                        std::string* error) const;
+};
+
+#endif  // PROTOBUF_FOR_PB_JAVA_GENERATOR_H__
@@ -0,0 +1,11 @@
+// Author: Walt Lin
+// Entry point of protoc-gen-jsonjava.
+
+#include <google/protobuf/compiler/plugin.h>
+
+#include "java_generator.h"
+
+int main(int argc, char* argv[]) {
+  MyCodeGenerator generator;
+  return google::protobuf::compiler::PluginMain(argc, argv, &generator);
+}
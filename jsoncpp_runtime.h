@@ -0,0 +1,628 @@
+// Author: Walt Lin
+// Runtime support for the code generated by protoc-gen-jsoncpp: appending
+// json values to a string, and a single-pass reader over a json buffer.
+// Header only, so generated code needs nothing but this file to build.
+
+#ifndef PROTOBUF_FOR_PB_JSONCPP_RUNTIME_H__
+#define PROTOBUF_FOR_PB_JSONCPP_RUNTIME_H__
+
+#include <ctype.h>
+#include <errno.h>
+#include <locale.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+
+namespace dxjson {
+
+// Switches the calling thread to the "C" locale while in scope, so that
+// printf and strtod use '.' for the decimal point whatever the locale of the
+// process is.
+class ScopedCLocale {
+ public:
+  ScopedCLocale() : old_(uselocale(CLocale())) {}
+  ~ScopedCLocale() { uselocale(old_); }
+
+ private:
+  static locale_t CLocale() {
+    static locale_t c = newlocale(LC_ALL_MASK, "C", (locale_t) 0);
+    return c;
+  }
+
+  locale_t old_;
+};
+
+// ---------------------------------------------------------------------------
+// Writing.
+
+// Appends the pre-encoded key ("\"name\":"), preceded by a comma unless it is
+// the first key of the object that started at "start".
+inline void AppendKey(std::string* out, size_t start, const char* key) {
+  if (out->size() != start) {
+    out->push_back(',');
+  }
+  out->append(key);
+}
+
+inline void AppendString(std::string* out, const std::string& s) {
+  static const char kHex[] = "0123456789abcdef";
+  out->push_back('"');
+  for (size_t i = 0; i < s.size(); i++) {
+    char c = s[i];
+    switch (c) {
+      case '"':
+      case '\\':
+      case '/':
+        out->push_back('\\');
+        out->push_back(c);
+        break;
+      case '\t': out->append("\\t"); break;
+      case '\b': out->append("\\b"); break;
+      case '\n': out->append("\\n"); break;
+      case '\r': out->append("\\r"); break;
+      case '\f': out->append("\\f"); break;
+      default:
+        if (static_cast<unsigned char>(c) <= 0x1F) {
+          out->append("\\u00");
+          out->push_back(kHex[(c >> 4) & 0xF]);
+          out->push_back(kHex[c & 0xF]);
+        } else {
+          out->push_back(c);
+        }
+        break;
+    }
+  }
+  out->push_back('"');
+}
+
+inline void AppendInt64(std::string* out, int64_t v) {
+  char buf[24];
+  out->append(buf, snprintf(buf, sizeof(buf), "%lld", (long long) v));
+}
+
+inline void AppendUint64(std::string* out, uint64_t v) {
+  char buf[24];
+  out->append(buf, snprintf(buf, sizeof(buf), "%llu", (unsigned long long) v));
+}
+
+inline void AppendBool(std::string* out, bool v) {
+  out->append(v ? "true" : "false");
+}
+
+// Json has no NaN or infinity, so these return false for them, as the java
+// writers throw. Otherwise they write the fewest significant digits, from 15
+// to 17, that read back as v: 0.1 stays 0.1 rather than 0.10000000000000001.
+inline bool AppendDouble(std::string* out, double v) {
+  if (isnan(v) || isinf(v)) {
+    return false;
+  }
+  ScopedCLocale c_locale;
+  char buf[32];
+  int len = 0;
+  for (int digits = 15; digits <= 17; digits++) {
+    len = snprintf(buf, sizeof(buf), "%.*g", digits, v);
+    if (strtod(buf, NULL) == v) {
+      break;
+    }
+  }
+  out->append(buf, len);
+  return true;
+}
+
+// Like AppendDouble, with 6 to 9 digits, which is enough for any float.
+inline bool AppendFloat(std::string* out, float v) {
+  if (isnan(v) || isinf(v)) {
+    return false;
+  }
+  ScopedCLocale c_locale;
+  char buf[32];
+  int len = 0;
+  for (int digits = 6; digits <= 9; digits++) {
+    len = snprintf(buf, sizeof(buf), "%.*g", digits, v);
+    if (strtof(buf, NULL) == v) {
+      break;
+    }
+  }
+  out->append(buf, len);
+  return true;
+}
+
+// Unsigned integer type with the size of a dx_packed element.
+template <int N> struct PackedWord;
+template <> struct PackedWord<4> { typedef uint32_t type; };
+template <> struct PackedWord<8> { typedef uint64_t type; };
+
+static const char kBase64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Appends a dx_packed field: a base64 string of the little-endian bytes of
+// the values.
+template <typename T>
+inline void AppendPacked(std::string* out, const T* values, int size) {
+  std::string bytes;
+  bytes.reserve(size * sizeof(T));
+  for (int i = 0; i < size; i++) {
+    typename PackedWord<sizeof(T)>::type bits;
+    memcpy(&bits, &values[i], sizeof(bits));
+    for (size_t j = 0; j < sizeof(bits); j++) {
+      bytes.push_back(static_cast<char>(bits >> (8 * j)));
+    }
+  }
+  std::string encoded;
+  encoded.reserve((bytes.size() + 2) / 3 * 4);
+  for (size_t i = 0; i < bytes.size(); i += 3) {
+    uint32_t bits = static_cast<unsigned char>(bytes[i]) << 16;
+    if (i + 1 < bytes.size()) {
+      bits |= static_cast<unsigned char>(bytes[i + 1]) << 8;
+    }
+    if (i + 2 < bytes.size()) {
+      bits |= static_cast<unsigned char>(bytes[i + 2]);
+    }
+    encoded.push_back(kBase64[bits >> 18]);
+    encoded.push_back(kBase64[(bits >> 12) & 63]);
+    encoded.push_back(i + 1 < bytes.size() ? kBase64[(bits >> 6) & 63] : '=');
+    encoded.push_back(i + 2 < bytes.size() ? kBase64[bits & 63] : '=');
+  }
+  AppendString(out, encoded);
+}
+
+// ---------------------------------------------------------------------------
+// Reading.
+
+// Reads json values in order from a buffer, without building a tree. All
+// methods return false on malformed input, after which ok() is false too.
+//
+// Objects are read as:
+//   if (!reader->BeginObject()) return false;
+//   while (reader->NextKey(&key)) { ...read or skip one value... }
+//   if (!reader->ok()) return false;
+// and arrays the same way with BeginArray and NextElement.
+class JsonReader {
+ public:
+  JsonReader(const char* data, size_t size)
+      : p_(data), end_(data + size), ok_(true), first_(false) {}
+
+  bool ok() const { return ok_; }
+
+  // True if only whitespace is left.
+  bool AtEnd() {
+    SkipWhitespace();
+    return ok_ && p_ == end_;
+  }
+
+  bool BeginObject() { return Begin('{'); }
+  bool BeginArray() { return Begin('['); }
+
+  // Moves to the next key of the current object and reads it. Returns false
+  // at the end of the object, or on error.
+  bool NextKey(std::string* key) {
+    if (!Next('}')) {
+      return false;
+    }
+    if (!ReadString(key)) {
+      return false;
+    }
+    SkipWhitespace();
+    if (p_ == end_ || *p_ != ':') {
+      return Fail();
+    }
+    p_++;
+    return true;
+  }
+
+  // Moves to the next element of the current array. Returns false at the end
+  // of the array, or on error.
+  bool NextElement() { return Next(']'); }
+
+  // Consumes a null value if there is one.
+  bool ConsumeNull() {
+    SkipWhitespace();
+    if (end_ - p_ >= 4 && memcmp(p_, "null", 4) == 0) {
+      p_ += 4;
+      return true;
+    }
+    return false;
+  }
+
+  bool ReadString(std::string* s) {
+    SkipWhitespace();
+    if (p_ == end_ || *p_ != '"') {
+      return Fail();
+    }
+    p_++;
+    s->clear();
+    while (p_ != end_ && *p_ != '"') {
+      if (*p_ != '\\') {
+        s->push_back(*p_++);
+        continue;
+      }
+      if (++p_ == end_) {
+        return Fail();
+      }
+      switch (*p_++) {
+        case '"': s->push_back('"'); break;
+        case '\\': s->push_back('\\'); break;
+        case '/': s->push_back('/'); break;
+        case 'b': s->push_back('\b'); break;
+        case 'f': s->push_back('\f'); break;
+        case 'n': s->push_back('\n'); break;
+        case 'r': s->push_back('\r'); break;
+        case 't': s->push_back('\t'); break;
+        case 'u': {
+          uint32_t c;
+          if (!ReadHex4(&c)) {
+            return false;
+          }
+          if (c >= 0xDC00 && c < 0xE000) {
+            // A low surrogate on its own.
+            return Fail();
+          }
+          if (c >= 0xD800 && c < 0xDC00) {
+            // Must be followed by a low surrogate, to make one code point.
+            if (end_ - p_ < 6 || p_[0] != '\\' || p_[1] != 'u') {
+              return Fail();
+            }
+            p_ += 2;
+            uint32_t low;
+            if (!ReadHex4(&low)) {
+              return false;
+            }
+            if (low < 0xDC00 || low >= 0xE000) {
+              return Fail();
+            }
+            c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+          }
+          AppendUtf8(s, c);
+          break;
+        }
+        default:
+          return Fail();
+      }
+    }
+    if (p_ == end_) {
+      return Fail();
+    }
+    p_++;
+    return true;
+  }
+
+  bool ReadBool(bool* v) {
+    SkipWhitespace();
+    if (end_ - p_ >= 4 && memcmp(p_, "true", 4) == 0) {
+      p_ += 4;
+      *v = true;
+      return true;
+    }
+    if (end_ - p_ >= 5 && memcmp(p_, "false", 5) == 0) {
+      p_ += 5;
+      *v = false;
+      return true;
+    }
+    return Fail();
+  }
+
+  // Numbers may also be given as strings, e.g. "12", as org.json allows.
+  bool ReadDouble(double* v) {
+    char buf[64];
+    if (!ReadNumber(buf, sizeof(buf))) {
+      return false;
+    }
+    ScopedCLocale c_locale;
+    char* end;
+    *v = strtod(buf, &end);
+    return *end == '\0' || Fail();
+  }
+
+  bool ReadFloat(float* v) {
+    double d;
+    if (!ReadDouble(&d)) {
+      return false;
+    }
+    *v = static_cast<float>(d);
+    return true;
+  }
+
+  bool ReadInt64(int64_t* v) {
+    char buf[64];
+    if (!ReadNumber(buf, sizeof(buf))) {
+      return false;
+    }
+    char* end;
+    errno = 0;
+    *v = strtoll(buf, &end, 10);
+    if (*end == '\0') {
+      // strtoll saturates on overflow.
+      return errno != ERANGE || Fail();
+    }
+    // Not an integer literal, e.g. 1.0 or 1e3. Doubles out of range can't
+    // be cast.
+    ScopedCLocale c_locale;
+    double d = strtod(buf, &end);
+    if (*end != '\0' ||
+        !(d >= -9223372036854775808.0 && d < 9223372036854775808.0)) {
+      return Fail();
+    }
+    *v = static_cast<int64_t>(d);
+    return true;
+  }
+
+  bool ReadUint64(uint64_t* v) {
+    char buf[64];
+    if (!ReadNumber(buf, sizeof(buf))) {
+      return false;
+    }
+    char* end;
+    errno = 0;
+    *v = strtoull(buf, &end, 10);
+    if (*end == '\0') {
+      // strtoull saturates on overflow, and negates negative numbers
+      // modulo 2^64.
+      return (errno != ERANGE && (buf[0] != '-' || *v == 0)) || Fail();
+    }
+    ScopedCLocale c_locale;
+    double d = strtod(buf, &end);
+    if (*end != '\0' || !(d >= 0 && d < 18446744073709551616.0)) {
+      return Fail();
+    }
+    *v = static_cast<uint64_t>(d);
+    return true;
+  }
+
+  bool ReadInt32(int32_t* v) {
+    int64_t x;
+    if (!ReadInt64(&x)) {
+      return false;
+    }
+    if (x < INT32_MIN || x > INT32_MAX) {
+      return Fail();
+    }
+    *v = static_cast<int32_t>(x);
+    return true;
+  }
+
+  bool ReadUint32(uint32_t* v) {
+    uint64_t x;
+    if (!ReadUint64(&x)) {
+      return false;
+    }
+    if (x > UINT32_MAX) {
+      return Fail();
+    }
+    *v = static_cast<uint32_t>(x);
+    return true;
+  }
+
+  // Reads an enum, which the java side writes by number when singular and by
+  // name in arrays and maps. Names go to *name; numbers, also quoted ones, to
+  // *number, with *name left empty.
+  bool ReadEnum(int32_t* number, std::string* name) {
+    name->clear();
+    SkipWhitespace();
+    if (p_ == end_ || *p_ != '"') {
+      return ReadInt32(number);
+    }
+    const char* start = p_;
+    if (!ReadString(name)) {
+      return false;
+    }
+    if (!name->empty() &&
+        (isdigit(static_cast<unsigned char>((*name)[0])) ||
+         (*name)[0] == '-')) {
+      name->clear();
+      p_ = start;
+      return ReadInt32(number);
+    }
+    return true;
+  }
+
+  // Reads a dx_packed value, see AppendPacked, appending the elements of type
+  // T to the repeated field "values".
+  template <typename T, typename Field>
+  bool ReadPacked(Field* values) {
+    std::string s;
+    if (!ReadString(&s)) {
+      return false;
+    }
+    size_t len = s.size();
+    while (len > 0 && s[len - 1] == '=') {
+      len--;
+    }
+    std::string bytes;
+    bytes.reserve(len * 3 / 4);
+    uint32_t bits = 0;
+    int pending = 0;
+    for (size_t i = 0; i < len; i++) {
+      const char* p = static_cast<const char*>(memchr(kBase64, s[i], 64));
+      if (p == NULL) {
+        return Fail();
+      }
+      bits = ((bits << 6) | (p - kBase64)) & 0xFFFF;
+      pending += 6;
+      if (pending >= 8) {
+        pending -= 8;
+        bytes.push_back(static_cast<char>(bits >> pending));
+      }
+    }
+    if (bytes.size() % sizeof(T) != 0) {
+      return Fail();
+    }
+    values->Reserve(values->size() + bytes.size() / sizeof(T));
+    for (size_t i = 0; i < bytes.size(); i += sizeof(T)) {
+      typename PackedWord<sizeof(T)>::type word = 0;
+      for (size_t j = 0; j < sizeof(T); j++) {
+        word |= static_cast<typename PackedWord<sizeof(T)>::type>(
+            static_cast<unsigned char>(bytes[i + j])) << (8 * j);
+      }
+      T v;
+      memcpy(&v, &word, sizeof(v));
+      values->Add(v);
+    }
+    return true;
+  }
+
+  // Skips over one value of any type, including nested objects and arrays.
+  bool SkipValue() {
+    SkipWhitespace();
+    if (p_ == end_) {
+      return Fail();
+    }
+    if (*p_ == '"') {
+      std::string ignored;
+      return ReadString(&ignored);
+    }
+    if (*p_ != '{' && *p_ != '[') {
+      // A scalar: number, true, false or null.
+      const char* start = p_;
+      while (p_ != end_ && (isalnum(static_cast<unsigned char>(*p_)) ||
+                            *p_ == '-' || *p_ == '+' || *p_ == '.')) {
+        p_++;
+      }
+      return p_ != start || Fail();
+    }
+    int depth = 0;
+    while (p_ != end_) {
+      char c = *p_++;
+      if (c == '"') {
+        p_--;
+        std::string ignored;
+        if (!ReadString(&ignored)) {
+          return false;
+        }
+      } else if (c == '{' || c == '[') {
+        depth++;
+      } else if (c == '}' || c == ']') {
+        if (--depth == 0) {
+          first_ = false;
+          return true;
+        }
+      }
+    }
+    return Fail();
+  }
+
+ private:
+  bool Fail() {
+    ok_ = false;
+    return false;
+  }
+
+  void SkipWhitespace() {
+    while (p_ != end_ &&
+           (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r')) {
+      p_++;
+    }
+  }
+
+  bool Begin(char open) {
+    SkipWhitespace();
+    if (p_ == end_ || *p_ != open) {
+      return Fail();
+    }
+    p_++;
+    first_ = true;
+    return true;
+  }
+
+  // Shared by NextKey and NextElement. first_ is true right after an opening
+  // bracket, and false after any complete value: a closing bracket always
+  // ends a value of the enclosing container, so nesting needs no stack.
+  bool Next(char close) {
+    if (!ok_) {
+      return false;
+    }
+    SkipWhitespace();
+    if (p_ == end_) {
+      return Fail();
+    }
+    if (*p_ == close) {
+      p_++;
+      first_ = false;
+      return false;
+    }
+    if (!first_) {
+      if (*p_ != ',') {
+        return Fail();
+      }
+      p_++;
+    }
+    first_ = false;
+    return true;
+  }
+
+  // Copies the next number token, or the contents of a string, into buf.
+  bool ReadNumber(char* buf, size_t size) {
+    SkipWhitespace();
+    bool quoted = p_ != end_ && *p_ == '"';
+    if (quoted) {
+      p_++;
+    }
+    size_t n = 0;
+    while (p_ != end_ && (isdigit(static_cast<unsigned char>(*p_)) ||
+                          *p_ == '-' || *p_ == '+' ||
+                          *p_ == '.' || *p_ == 'e' || *p_ == 'E')) {
+      if (n + 1 == size) {
+        return Fail();
+      }
+      buf[n++] = *p_++;
+    }
+    buf[n] = '\0';
+    if (quoted) {
+      if (p_ == end_ || *p_ != '"') {
+        return Fail();
+      }
+      p_++;
+    }
+    return n > 0 || Fail();
+  }
+
+  bool ReadHex4(uint32_t* c) {
+    if (end_ - p_ < 4) {
+      return Fail();
+    }
+    *c = 0;
+    for (int i = 0; i < 4; i++) {
+      char h = *p_++;
+      *c <<= 4;
+      if (h >= '0' && h <= '9') {
+        *c |= h - '0';
+      } else if (h >= 'a' && h <= 'f') {
+        *c |= h - 'a' + 10;
+      } else if (h >= 'A' && h <= 'F') {
+        *c |= h - 'A' + 10;
+      } else {
+        return Fail();
+      }
+    }
+    return true;
+  }
+
+  static void AppendUtf8(std::string* s, uint32_t c) {
+    if (c < 0x80) {
+      s->push_back(static_cast<char>(c));
+    } else if (c < 0x800) {
+      s->push_back(static_cast<char>(0xC0 | (c >> 6)));
+      s->push_back(static_cast<char>(0x80 | (c & 0x3F)));
+    } else if (c < 0x10000) {
+      s->push_back(static_cast<char>(0xE0 | (c >> 12)));
+      s->push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+      s->push_back(static_cast<char>(0x80 | (c & 0x3F)));
+    } else {
+      s->push_back(static_cast<char>(0xF0 | (c >> 18)));
+      s->push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3F)));
+      s->push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+      s->push_back(static_cast<char>(0x80 | (c & 0x3F)));
+    }
+  }
+
+  const char* p_;
+  const char* end_;
+  bool ok_;
+  bool first_;
+};
+
+}  // namespace dxjson
+
+#endif  // PROTOBUF_FOR_PB_JSONCPP_RUNTIME_H__
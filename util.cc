@@ -1,5 +1,9 @@
 #include "util.h"
 #include <stdio.h>
+#include <google/protobuf/descriptor.h>
+
+#include "java_helper.h"
+#include "options.pb.h"
 
 namespace google {
 namespace protobuf {
@@ -21,6 +25,93 @@ std::string SimpleItoa(int x) {
   return std::string(buf);
 }
 
+// Sigh; we use "_id" as a field name, and we don't want to turn that into "Id".
+std::string JsonFieldName(const FieldDescriptor* field) {
+  return field->name() == "_id" ? "_id" : java::UnderscoresToCamelCase(field);
+}
+
+bool GetMapFields(const FieldDescriptor* field,
+                  const FieldDescriptor** key,
+                  const FieldDescriptor** val,
+                  std::string* error) {
+  const FieldOptions& opts = field->options();
+  std::string map_key = opts.GetExtension(dx_map_key);
+  std::string map_val = opts.GetExtension(dx_map_val);
+  if (map_key.empty()) {
+    return false;
+  }
+  const Descriptor* msg = field->message_type();
+  *key = msg == NULL ? NULL : msg->FindFieldByName(map_key);
+  *val = msg == NULL ? NULL : msg->FindFieldByName(map_val);
+  if (*key == NULL || *val == NULL) {
+    error->assign("couldn't look up key or val");
+  }
+  return true;
+}
+
+bool IsPackedField(const FieldDescriptor* field, std::string* error) {
+  if (!field->options().GetExtension(dx_packed)) {
+    return false;
+  }
+  switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+    case FieldDescriptor::CPPTYPE_FLOAT:
+    case FieldDescriptor::CPPTYPE_INT64:
+    case FieldDescriptor::CPPTYPE_UINT64:
+    case FieldDescriptor::CPPTYPE_INT32:
+    case FieldDescriptor::CPPTYPE_UINT32:
+      if (field->is_repeated()) {
+        return true;
+      }
+      break;
+    default:
+      break;
+  }
+  error->assign("dx_packed field " + field->full_name() +
+                " must be a repeated number");
+  return true;
+}
+
+bool IsParallelField(const FieldDescriptor* field, std::string* error) {
+  if (!field->options().GetExtension(dx_parallel)) {
+    return false;
+  }
+  if (!field->is_repeated() ||
+      field->type() != FieldDescriptor::TYPE_MESSAGE ||
+      !field->options().GetExtension(dx_map_key).empty()) {
+    error->assign("dx_parallel field " + field->full_name() +
+                  " must be a repeated message");
+  }
+  return true;
+}
+
+bool IsLazyField(const FieldDescriptor* field, std::string* error) {
+  if (!field->options().GetExtension(dx_lazy)) {
+    return false;
+  }
+  if (field->is_repeated() ||
+      field->type() != FieldDescriptor::TYPE_MESSAGE) {
+    error->assign("dx_lazy field " + field->full_name() +
+                  " must be a singular message");
+  }
+  return true;
+}
+
+static void CollectMessages(const Descriptor* d,
+                            std::vector<const Descriptor*>* messages) {
+  messages->push_back(d);
+  for (int i = 0; i < d->nested_type_count(); i++) {
+    CollectMessages(d->nested_type(i), messages);
+  }
+}
+
+void CollectMessages(const FileDescriptor* file,
+                     std::vector<const Descriptor*>* messages) {
+  for (int i = 0; i < file->message_type_count(); i++) {
+    CollectMessages(file->message_type(i), messages);
+  }
+}
+
 }  // namespace compiler
 }  // namespace protobuf
 }  // namespace google
@@ -5,9 +5,15 @@
 #define PROTOBUF_FOR_PB_UTIL_H__
 
 #include <string>
+#include <vector>
 
 namespace google {
 namespace protobuf {
+
+class Descriptor;
+class FieldDescriptor;
+class FileDescriptor;
+
 namespace compiler {
 
 std::string Basename(const std::string& fn);
@@ -16,6 +22,33 @@ std::string SimpleItoa(int x);
 
 extern const char kFileHeader[];
 
+// The key used for the field in json, e.g. "foo_bar" becomes "fooBar".
+std::string JsonFieldName(const FieldDescriptor* field);
+
+// If the field is marked as a map with dx_map_key/dx_map_val, looks up the
+// key and value fields of its message type and returns true. Sets error if
+// the fields named by the options don't exist.
+bool GetMapFields(const FieldDescriptor* field,
+                  const FieldDescriptor** key,
+                  const FieldDescriptor** val,
+                  std::string* error);
+
+// Whether the field is marked dx_packed. Sets error if it is, but isn't a
+// repeated numeric field.
+bool IsPackedField(const FieldDescriptor* field, std::string* error);
+
+// Whether the field is marked dx_parallel. Sets error if it is, but isn't a
+// repeated message field (and not a dx_map_key map).
+bool IsParallelField(const FieldDescriptor* field, std::string* error);
+
+// Whether the field is marked dx_lazy. Sets error if it is, but isn't a
+// singular message field.
+bool IsLazyField(const FieldDescriptor* field, std::string* error);
+
+// Appends all messages in the file, including nested ones, parents first.
+void CollectMessages(const FileDescriptor* file,
+                     std::vector<const Descriptor*>* messages);
+
 }  // namespace compiler
 }  // namespace protobuf
 }  // namespace google